@@ -35,19 +35,97 @@ typedef enum {
     NK_FORMAT_STRING_ERROR_WRONG_PRETIFFY,
     NK_FORMAT_STRING_ERROR_REGEX,
     NK_FORMAT_STRING_ERROR_UNKNOWN_TOKEN,
+    NK_FORMAT_STRING_ERROR_WRONG_BLOB,
 } NkFormatStringError;
 
 typedef struct _NkFormatString NkFormatString;
+typedef struct _NkFormatStringRenderState NkFormatStringRenderState;
+
+typedef struct {
+    const gchar *name;
+    guint64 value;
+} NkFormatStringReference;
+
+typedef enum {
+    NK_FORMAT_STRING_VALUE_TYPE_NONE,
+    NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN,
+    NK_FORMAT_STRING_VALUE_TYPE_INT64,
+    NK_FORMAT_STRING_VALUE_TYPE_UINT64,
+    NK_FORMAT_STRING_VALUE_TYPE_DOUBLE,
+    NK_FORMAT_STRING_VALUE_TYPE_STRING,
+    NK_FORMAT_STRING_VALUE_TYPE_VARIANT,
+} NkFormatStringValueType;
+
+typedef struct {
+    NkFormatStringValueType type;
+    union {
+        gboolean boolean;
+        gint64 int64;
+        guint64 uint64;
+        gdouble double_;
+        const gchar *string;
+        GVariant *variant;
+    } data;
+} NkFormatStringValue;
+
+typedef struct {
+    gconstpointer buffer;
+    gsize size;
+} NkFormatStringOutputVector;
+
+typedef struct {
+    const gchar *name;
+    const gchar *key;
+    gint64 index;
+    guint64 value;
+    guint64 calls;
+    guint64 callback_time;
+    guint64 format_time;
+    guint64 bytes;
+} NkFormatStringTokenStats;
 
 typedef GVariant *(*NkFormatStringReplaceReferenceCallback)(const gchar *name, guint64 value, gpointer user_data);
+typedef void (*NkFormatStringReplaceReferencesCallback)(const NkFormatStringReference *references, gsize size, GVariant **data, gpointer user_data);
+typedef void (*NkFormatStringReplaceValueCallback)(const gchar *name, guint64 value, NkFormatStringValue *data, gpointer user_data);
+typedef gboolean (*NkFormatStringWriteCallback)(const NkFormatStringOutputVector *vectors, gsize size, gpointer user_data, GError **error);
 
 GQuark nk_format_string_error_quark(void);
 #define NK_FORMAT_STRING_ERROR (nk_format_string_error_quark())
 
 NkFormatString *nk_format_string_parse(gchar *string, gunichar identifier, GError **error);
+NkFormatString *nk_format_string_parse_const(const gchar *string, gssize length, gunichar identifier, GError **error);
 NkFormatString *nk_format_string_parse_enum(gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *used_tokens, GError **error);
+NkFormatString *nk_format_string_parse_shared(const gchar *string, gunichar identifier, GError **error);
+NkFormatString *nk_format_string_parse_enum_shared(const gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *used_tokens, GError **error);
+void nk_format_string_cache_set_size(gsize size);
+void nk_format_string_cache_clear(void);
+void nk_format_string_cache_get_stats(guint64 *hits, guint64 *misses);
+void nk_format_string_replace_cache_set_size(gsize size);
+GBytes *nk_format_string_save(const NkFormatString *format_string);
+NkFormatString *nk_format_string_load(GBytes *bytes, GError **error);
 NkFormatString *nk_format_string_ref(NkFormatString *format_string);
 void nk_format_string_unref(NkFormatString *format_string);
 gchar *nk_format_string_replace(const NkFormatString *format_string, NkFormatStringReplaceReferenceCallback callback, gpointer user_data);
+void nk_format_string_replace_into(const NkFormatString *format_string, GString *string, NkFormatStringReplaceReferenceCallback callback, gpointer user_data);
+gboolean nk_format_string_replace_write(const NkFormatString *format_string, NkFormatStringReplaceReferenceCallback callback, gpointer user_data, NkFormatStringWriteCallback write_callback, gpointer write_user_data, GError **error);
+#ifdef G_OS_UNIX
+gboolean nk_format_string_replace_fd(const NkFormatString *format_string, gint fd, NkFormatStringReplaceReferenceCallback callback, gpointer user_data, GError **error);
+#endif /* G_OS_UNIX */
+const NkFormatStringReference *nk_format_string_get_references(const NkFormatString *format_string, gsize *size);
+void nk_format_string_set_profiling(NkFormatString *format_string, gboolean profiling);
+void nk_format_string_reset_stats(NkFormatString *format_string);
+NkFormatStringTokenStats *nk_format_string_get_stats(const NkFormatString *format_string, gsize *size, guint64 *renders);
+gchar *nk_format_string_get_stats_json(const NkFormatString *format_string);
+gchar *nk_format_string_replace_batch(const NkFormatString *format_string, NkFormatStringReplaceReferencesCallback callback, gpointer user_data);
+void nk_format_string_replace_batch_into(const NkFormatString *format_string, GString *string, NkFormatStringReplaceReferencesCallback callback, gpointer user_data);
+gchar *nk_format_string_replace_values(const NkFormatString *format_string, NkFormatStringReplaceValueCallback callback, gpointer user_data);
+void nk_format_string_replace_values_into(const NkFormatString *format_string, GString *string, NkFormatStringReplaceValueCallback callback, gpointer user_data);
+
+NkFormatStringRenderState *nk_format_string_render_state_new(NkFormatString *format_string);
+void nk_format_string_render_state_free(NkFormatStringRenderState *state);
+void nk_format_string_render_state_invalidate(NkFormatStringRenderState *state, const gchar *name);
+void nk_format_string_render_state_invalidate_value(NkFormatStringRenderState *state, guint64 value);
+void nk_format_string_render_state_invalidate_all(NkFormatStringRenderState *state);
+const gchar *nk_format_string_render_state_replace(NkFormatStringRenderState *state, NkFormatStringReplaceReferenceCallback callback, gpointer user_data);
 
 #endif /* __NK_UTILS_FORMAT_STRING_H__ */
@@ -0,0 +1,36 @@
+/*
+ * libnkutils/format-string - Miscellaneous utilities, format string module internals
+ *
+ * Copyright © 2011-2024 Morgane "Sardem FF7" Glidic
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __NK_UTILS_FORMAT_STRING_INTERNAL_H__
+#define __NK_UTILS_FORMAT_STRING_INTERNAL_H__
+
+#include <glib.h>
+
+/* Same output as printf("%" G_GINT64_FORMAT), "%" G_GUINT64_FORMAT and "%*.*lf" (or "%0*.*lf") */
+void nk_format_string_append_int64(GString *string, gint64 value);
+void nk_format_string_append_uint64(GString *string, guint64 value);
+void nk_format_string_append_double(GString *string, gdouble value, gint width, gint precision, gboolean zero);
+
+#endif /* __NK_UTILS_FORMAT_STRING_INTERNAL_H__ */
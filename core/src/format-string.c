@@ -34,12 +34,23 @@
 
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <locale.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
 #include <glib.h>
+#ifdef G_OS_UNIX
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#endif /* G_OS_UNIX */
 
 #include "nkutils-enum.h"
 
 #include "nkutils-format-string.h"
+#include "format-string-internal.h"
 
 /**
  * SECTION: nkutils-format-string
@@ -70,6 +81,7 @@
  * @NK_FORMAT_STRING_ERROR_WRONG_PRETIFFY: Error in `${reference(prettify)}` notation
  * @NK_FORMAT_STRING_ERROR_REGEX: Wrong regex in `${reference/regex/replacement}` notation
  * @NK_FORMAT_STRING_ERROR_UNKNOWN_TOKEN: Unknown token in enum-based format list
+ * @NK_FORMAT_STRING_ERROR_WRONG_BLOB: Invalid data in nk_format_string_load()
  *
  * Error codes returned by parsing an #NkFormatString.
  */
@@ -88,6 +100,13 @@ typedef struct {
     gchar *false_;
 } NkFormatStringSwitch;
 
+/* A [start:end) window of a joined array, see _nk_format_string_slice_bound() */
+typedef struct {
+    gboolean sliced;
+    gint64 start;
+    gint64 end;
+} NkFormatStringSlice;
+
 typedef enum {
     NK_FORMAT_STRING_PRETTIFY_NONE = 0,
     NK_FORMAT_STRING_PRETTIFY_FLOAT = 'f',
@@ -98,10 +117,13 @@ typedef enum {
     NK_FORMAT_STRING_PRETTIFY_JSON = 'j',
 } NkFormatStringPrettifyType;
 
+typedef struct _NkFormatStringTimeCache NkFormatStringTimeCache;
+
 typedef struct {
     NkFormatStringPrettifyType type;
-    gchar format[10]; /* %0*.*lf%s + \0 */
+    gboolean zero;
     const gchar *time_format;
+    gint time_granularity;
     NkFormatString *duration_format;
     gint width;
     gint precision;
@@ -151,25 +173,160 @@ typedef struct {
     guint16 ms, us, ns;
 } NkFormatStringPrettifyDurationData;
 
+/*
+ * The regex may be compiled lazily (see nk_format_string_load()),
+ * and is not compiled at all for literal patterns,
+ * the list ends with a %NULL replacement.
+ */
 typedef struct {
     GRegex *regex;
+    const gchar *pattern;
+    GRegexCompileFlags flags;
+    gsize length; /* Of a literal pattern, 0 otherwise */
     NkFormatString *replacement;
 } NkFormatStringRegex;
 
+typedef struct _NkFormatStringReplaceCache NkFormatStringReplaceCache;
+typedef struct _NkFormatStringRegexChain NkFormatStringRegexChain;
+
 typedef struct {
-    const gchar *string;
-    const gchar *name;
-    const gchar *key;
-    gint64 index;
-    guint64 value;
     NkFormatString *fallback;
     NkFormatString *substitute;
     NkFormatStringRange range;
     NkFormatStringSwitch switch_;
+    NkFormatStringSlice slice;
     NkFormatStringPrettify prettify;
     NkFormatStringRegex *replace;
+    NkFormatStringRegexChain *replace_chain;
+    /* Created while rendering, see nk_format_string_replace() */
+    NkFormatStringTimeCache *time_cache;
+    NkFormatStringReplaceCache *replace_cache;
+} NkFormatStringTokenModifiers;
+
+static const NkFormatStringTokenModifiers _nk_format_string_no_modifiers = { .fallback = NULL };
+
+/*
+ * Literals and plain references are the most common tokens,
+ * so everything else lives in modifiers, %NULL for them.
+ * This keeps a token in a single cache line.
+ */
+typedef struct {
+    const gchar *string;
+    gsize length;
+    const gchar *name;
+    const gchar *key;
+    gint64 index;
+    guint64 value;
+    NkFormatStringTokenModifiers *modifiers;
     gboolean no_data;
 } NkFormatStringToken;
+G_STATIC_ASSERT(sizeof(NkFormatStringToken) <= 64);
+
+#define _nk_format_string_token_modifiers(token) ( ( (token)->modifiers != NULL ) ? (token)->modifiers : &_nk_format_string_no_modifiers )
+
+typedef enum {
+    NK_FORMAT_STRING_OP_END,
+    NK_FORMAT_STRING_OP_LITERAL,
+    NK_FORMAT_STRING_OP_FETCH,
+    NK_FORMAT_STRING_OP_DROP,
+    NK_FORMAT_STRING_OP_DATA,
+    NK_FORMAT_STRING_OP_RANGE,
+    NK_FORMAT_STRING_OP_SWITCH,
+    NK_FORMAT_STRING_OP_PRETTIFY,
+    NK_FORMAT_STRING_OP_REPLACE,
+} NkFormatStringOpCode;
+
+/*
+ * A parsed format string is compiled to a flat program.
+ * Each reference is a FETCH op, which jumps to its fallback (or to the end
+ * of the reference) when there is no data, followed by exactly one op
+ * consuming the data, which jumps over the fallback.
+ * Fallback and substitute formats are inlined.
+ * FETCH ops also carry the index of their reference in the distinct
+ * references list of the top-level format string, shared with the
+ * regex replacement programs.
+ * LITERAL ops carry their precomputed length.
+ */
+typedef struct {
+    NkFormatStringOpCode code;
+    gsize jump;
+    union {
+        gsize reference;
+        gsize length;
+    };
+    union {
+        const gchar *string;
+        const NkFormatStringToken *token;
+    };
+} NkFormatStringOp;
+
+/*
+ * A format string and all its sub-formats (fallback, substitute,
+ * regex replacement and duration formats) are allocated from a single
+ * arena, owned by the top-level one, and released at once.
+ * Only the caches created while rendering live outside of it.
+ */
+typedef struct _NkFormatStringArenaChunk NkFormatStringArenaChunk;
+struct _NkFormatStringArenaChunk {
+    NkFormatStringArenaChunk *next;
+    gsize size;
+    gsize used;
+};
+
+typedef struct {
+    NkFormatStringArenaChunk *chunks;
+} NkFormatStringArena;
+
+#define NK_FORMAT_STRING_ARENA_ALIGNMENT 16
+#define NK_FORMAT_STRING_ARENA_CHUNK_SIZE 1024
+#define _nk_format_string_arena_align(size) ( ( (size) + NK_FORMAT_STRING_ARENA_ALIGNMENT - 1 ) & ~( (gsize) NK_FORMAT_STRING_ARENA_ALIGNMENT - 1 ) )
+#define NK_FORMAT_STRING_ARENA_CHUNK_HEADER_SIZE _nk_format_string_arena_align(sizeof(NkFormatStringArenaChunk))
+
+static NkFormatStringArenaChunk *
+_nk_format_string_arena_add_chunk(NkFormatStringArena *arena, gsize size)
+{
+    NkFormatStringArenaChunk *chunk;
+
+    chunk = g_malloc0(NK_FORMAT_STRING_ARENA_CHUNK_HEADER_SIZE + size);
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    arena->chunks = chunk;
+
+    return chunk;
+}
+
+/*
+ * The first chunk is sized from a hint, see _nk_format_string_new(),
+ * and the next ones grow by a fixed step, so a big first chunk
+ * does not make the next ones bigger
+ */
+static gpointer
+_nk_format_string_arena_alloc(NkFormatStringArena *arena, gsize size)
+{
+    NkFormatStringArenaChunk *chunk = arena->chunks;
+
+    size = _nk_format_string_arena_align(size);
+    if ( ( chunk == NULL ) || ( ( chunk->size - chunk->used ) < size ) )
+        chunk = _nk_format_string_arena_add_chunk(arena, MAX(NK_FORMAT_STRING_ARENA_CHUNK_SIZE, size));
+
+    gpointer data = (gchar *) chunk + NK_FORMAT_STRING_ARENA_CHUNK_HEADER_SIZE + chunk->used;
+    chunk->used += size;
+    return data;
+}
+
+static void
+_nk_format_string_arena_release(NkFormatStringArena *arena)
+{
+    NkFormatStringArenaChunk *chunk, *next;
+    for ( chunk = arena->chunks ; chunk != NULL ; chunk = next )
+    {
+        next = chunk->next;
+        g_free(chunk);
+    }
+}
+
+typedef struct _NkFormatStringProfile NkFormatStringProfile;
+static void _nk_format_string_profile_free(NkFormatStringProfile *profile);
 
 /**
  * NkFormatString:
@@ -177,98 +334,418 @@ typedef struct {
  * An opaque structure holding the format string.
  */
 struct _NkFormatString {
-    guint64 ref_count;
+    gint ref_count;
+    NkFormatString *root;
+    NkFormatStringArena arena; /* Of the root only */
     gboolean owned;
     gchar *string;
     gsize length;
     NkFormatStringToken *tokens;
     gsize size;
+    NkFormatStringOp *program;
+    NkFormatStringReference *references;
+    gsize references_size;
+    gsize *segments;
+    gsize segments_size;
+    GVariant *blob;
+    NkFormatStringProfile *profile;
 };
 
+/*
+ * What a format string of size tokens needs in the arena:
+ * at most every other token is a reference, compiled to two ops,
+ * a literal is compiled to one, and each top-level token is a segment
+ */
+static gsize
+_nk_format_string_arena_hint(gsize size)
+{
+    gsize references = ( size + 1 ) / 2;
+    return _nk_format_string_arena_align(sizeof(NkFormatStringToken) * size)
+        + _nk_format_string_arena_align(sizeof(NkFormatStringOp) * ( size + references + 1 ))
+        + _nk_format_string_arena_align(sizeof(NkFormatStringReference) * references)
+        + _nk_format_string_arena_align(sizeof(gsize) * ( size + 1 ));
+}
+
+/* size is the exact size of the first arena chunk of a new root, after the format string itself */
+static NkFormatString *
+_nk_format_string_new(NkFormatString *root, gsize size)
+{
+    NkFormatString *self;
+
+    if ( root == NULL )
+    {
+        NkFormatStringArena arena = { .chunks = NULL };
+        _nk_format_string_arena_add_chunk(&arena, _nk_format_string_arena_align(sizeof(NkFormatString)) + size);
+        self = _nk_format_string_arena_alloc(&arena, sizeof(NkFormatString));
+        self->arena = arena;
+        self->root = self;
+    }
+    else
+    {
+        self = _nk_format_string_arena_alloc(&root->arena, sizeof(NkFormatString));
+        self->root = root;
+    }
+    self->ref_count = 1;
+
+    return self;
+}
+
+#define _nk_format_string_alloc(self, type, n) ( (type *) _nk_format_string_arena_alloc(&(self)->root->arena, sizeof(type) * (n)) )
 
 NK_EXPORT
 G_DEFINE_QUARK(nk_format_string_error-quark, nk_format_string_error)
 
+#ifndef __SSE2__
+#define _nk_format_string_swar_ones (G_GUINT64_CONSTANT(0x0101010101010101))
+#define _nk_format_string_swar_highs (G_GUINT64_CONSTANT(0x8080808080808080))
+#define _nk_format_string_swar_has_zero(v) ( ( (v) - _nk_format_string_swar_ones ) & ~(v) & _nk_format_string_swar_highs )
+#define _nk_format_string_swar_has_byte(v, c) _nk_format_string_swar_has_zero((v) ^ ( _nk_format_string_swar_ones * (guchar) (c) ))
+#endif /* ! __SSE2__ */
+
+/*
+ * Returns the offset of the first a, b or c byte in s,
+ * or length if none, checking a whole block of bytes at a time
+ */
+static gsize
+_nk_format_string_scan(const gchar *s, gsize length, gchar a, gchar b, gchar c)
+{
+    gsize i = 0;
+
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    for ( ; ( i + 16 ) <= length ; i += 16 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) ( s + i ));
+        __m128i m;
+        m = _mm_cmpeq_epi8(v, va);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, vb));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, vc));
+        gint mask = _mm_movemask_epi8(m);
+        if ( mask != 0 )
+            return i + g_bit_nth_lsf(mask, -1);
+    }
+#else /* ! __SSE2__ */
+    for ( ; ( i + sizeof(guint64) ) <= length ; i += sizeof(guint64) )
+    {
+        guint64 v;
+        memcpy(&v, s + i, sizeof(guint64));
+        /* Found byte by byte below */
+        if ( _nk_format_string_swar_has_byte(v, a) || _nk_format_string_swar_has_byte(v, b) || _nk_format_string_swar_has_byte(v, c) )
+            break;
+    }
+#endif /* ! __SSE2__ */
+
+    for ( ; i < length ; ++i )
+    {
+        if ( ( s[i] == a ) || ( s[i] == b ) || ( s[i] == c ) )
+            return i;
+    }
+    return length;
+}
+
+/* Most of our delimiters are ASCII, where memchr() is much faster */
 static gchar *
-_nk_format_string_strchr_escape(gchar *s, gsize l, gunichar c, gunichar pair_c)
+_nk_format_string_utf8_strchr(const gchar *s, gsize length, gunichar c)
 {
-    gchar *e = s + l;
+    if ( c < 0x80 )
+        return memchr(s, c, length);
+    return g_utf8_strchr(s, length, c);
+}
 
+/* References are alpha/-/_ only */
+static const gchar *
+_nk_format_string_name_end(const gchar *w, const gchar *e)
+{
+    while ( w < e )
+    {
+        guchar c = *w;
+        if ( c < 0x80 )
+        {
+            if ( ! ( g_ascii_isalpha(c) || ( c == '-' ) || ( c == '_' ) ) )
+                break;
+            ++w;
+        }
+        else if ( g_unichar_isalpha(g_utf8_get_char(w)) )
+            w = g_utf8_next_char(w);
+        else
+            break;
+    }
+    return w;
+}
+
+#define _nk_format_string_is_escaped(w, c, pair_c) ( ( *(w) == (c) ) || ( ( (pair_c) != '\0' ) && ( *(w) == (pair_c) ) ) )
+
+/*
+ * Searches c in [w, e), skipping escaped characters and nested pairs.
+ * c and pair_c are ASCII, so we can work on bytes:
+ * UTF-8 continuation bytes never match them.
+ * escapes is set if there are escaped c or pair_c to remove before it.
+ */
+static const gchar *
+_nk_format_string_strchr_escape_const(const gchar *w, const gchar *e, gchar c, gchar pair_c, gboolean *escapes)
+{
     gsize pair_count = 0;
-    gchar *w = s;
-    gunichar wc = '\0', pc;
 
-    for ( ; w < e ; w = g_utf8_next_char(w) )
+    while ( ( w += _nk_format_string_scan(w, e - w, c, ( pair_c != '\0' ) ? pair_c : c, '\\') ) < e )
     {
-        pc = wc;
-        wc = g_utf8_get_char(w);
-
-        if ( pc == '\\' )
+        if ( *w == '\\' )
         {
-            /* Escaped, search for next one */
-            if ( wc == '\\' )
-                /* Escaping a backslash, avoid escaping the next char */
-                wc = '\0';
-            else if ( ( wc == c ) || ( wc == pair_c ) )
-            {
-                w = g_utf8_prev_char(w);
-                pc = wc;
-                gchar *to, *from;
-                for ( to = w, from = g_utf8_next_char(w) ; from <= e ; ++to, ++from )
-                    *to = *from;
-                e = to;
-            }
+            if ( ( w + 1 ) == e )
+                break;
+            if ( _nk_format_string_is_escaped(w + 1, c, pair_c) && ( escapes != NULL ) )
+                *escapes = TRUE;
+            /* Escaped, search for next one, escaping a backslash avoids escaping the next char */
+            w += 2;
             continue;
         }
 
-        /* Maybe do we open a paired character */
-        if ( ( pair_c != '\0' ) && ( wc == pair_c ) )
+        if ( *w == c )
+        {
+            /* We found our character, check if it is the right occurence */
+            if ( pair_count == 0 )
+                return w;
+            /* We had an opened pair, close it */
+            --pair_count;
+        }
+        else
+            /* We open a paired character */
             ++pair_count;
+        ++w;
+    }
+    return NULL;
+}
 
-        if ( wc != c )
-            continue;
+/*
+ * Searches c in s like above, and removes the backslash of escaped
+ * c and pair_c before it, in a single pass.
+ *
+ * If next is %NULL, the rest of s (up to s[l] included) is moved back,
+ * even if c is not found.
+ * Otherwise, only what is before c is touched: *next is set to the
+ * original position after c, and c is moved right after the unescaped part.
+ * This avoids moving the whole tail of a format string for each token.
+ */
+static gchar *
+_nk_format_string_strchr_escape(gchar *s, gsize l, gchar c, gchar pair_c, gchar **next)
+{
+    gchar *e = s + l;
+    gboolean escapes = FALSE;
+    gchar *found = (gchar *) _nk_format_string_strchr_escape_const(s, e, c, pair_c, &escapes);
+
+    if ( next != NULL )
+    {
+        if ( found == NULL )
+            return NULL;
+        *next = found + 1;
+    }
+    if ( ! escapes )
+        return found;
 
-        /* We found our character, check if it is the right occurence */
+    gchar *end = ( found != NULL ) ? found : e;
+    gchar *w = s, *to = s;
+    while ( w < end )
+    {
+        gchar *b = memchr(w, '\\', end - w);
+        if ( b == NULL )
+            b = end;
+        memmove(to, w, b - w);
+        to += b - w;
+        if ( b == end )
+            break;
 
-        if ( ( pair_c != '\0' ) && ( pair_count > 0 ) )
+        w = b + 1;
+        if ( w == end )
         {
-            /* We had an opened pair, close it */
-            --pair_count;
-            continue;
+            *to++ = '\\';
+            break;
         }
+        if ( ! _nk_format_string_is_escaped(w, c, pair_c) )
+            *to++ = '\\';
+        *to++ = *w++;
+    }
+
+    if ( next != NULL )
+        *to = c;
+    else if ( found != NULL )
+        memmove(to, found, e - found + 1);
+    else
+        *to = *e;
+
+    return ( found != NULL ) ? to : NULL;
+}
+
+/*
+ * Returns the time span (in seconds) during which a time format
+ * gives the same result, from the finest unit it displays.
+ * Sub-second formats give 0, unknown conversions give 1.
+ */
+static gint
+_nk_format_string_time_format_granularity(const gchar *format)
+{
+    gint granularity = 86400;
+    const gchar *w;
+
+    for ( w = strchr(format, '%') ; w != NULL ; w = strchr(w, '%') )
+    {
+        ++w;
+        /* Padding, alternative and timezone modifiers */
+        while ( ( *w == '-' ) || ( *w == '_' ) || ( *w == '0' ) || ( *w == ':' ) || ( *w == 'E' ) || ( *w == 'O' ) )
+            ++w;
 
-        return w;
+        switch ( *w )
+        {
+        case '\0':
+            return granularity;
+        case 'f':
+            return 0;
+        case 'M':
+        case 'R':
+        case 'z':
+        case 'Z':
+            granularity = MIN(granularity, 60);
+        break;
+        case 'H':
+        case 'I':
+        case 'k':
+        case 'l':
+        case 'p':
+        case 'P':
+            granularity = MIN(granularity, 3600);
+        break;
+        case 'a':
+        case 'A':
+        case 'b':
+        case 'B':
+        case 'C':
+        case 'd':
+        case 'e':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'h':
+        case 'j':
+        case 'm':
+        case 'q':
+        case 'u':
+        case 'V':
+        case 'w':
+        case 'x':
+        case 'y':
+        case 'Y':
+        case 'n':
+        case 't':
+        case '%':
+        break;
+        default:
+            granularity = 1;
+        }
+        ++w;
     }
-    return NULL;
+
+    return granularity;
 }
 
+/* Literal patterns need no regex, see _nk_format_string_literal_replace() */
+static gboolean
+_nk_format_string_regex_is_literal(const gchar *pattern, GRegexCompileFlags flags)
+{
+    if ( ( flags & ~G_REGEX_OPTIMIZE ) != 0 )
+        return FALSE;
+    if ( *pattern == '\0' )
+        return FALSE;
+    return ( strpbrk(pattern, "\\^$.[]|()?*+{}") == NULL );
+}
+
+/*
+ * The #GVariant types we render are classified once, from their type character,
+ * and then dispatched through tables instead of a chain of type checks.
+ */
+typedef enum {
+    NK_FORMAT_STRING_VARIANT_CLASS_OTHER = 0,
+    NK_FORMAT_STRING_VARIANT_CLASS_STRING,
+    NK_FORMAT_STRING_VARIANT_CLASS_BOOLEAN,
+    NK_FORMAT_STRING_VARIANT_CLASS_BYTE,
+    NK_FORMAT_STRING_VARIANT_CLASS_INT16,
+    NK_FORMAT_STRING_VARIANT_CLASS_UINT16,
+    NK_FORMAT_STRING_VARIANT_CLASS_INT32,
+    NK_FORMAT_STRING_VARIANT_CLASS_UINT32,
+    NK_FORMAT_STRING_VARIANT_CLASS_INT64,
+    NK_FORMAT_STRING_VARIANT_CLASS_UINT64,
+    NK_FORMAT_STRING_VARIANT_CLASS_DOUBLE,
+    NK_FORMAT_STRING_VARIANT_CLASS_ARRAY,
+    NK_FORMAT_STRING_VARIANT_CLASS_VARIANT,
+    NK_FORMAT_STRING_VARIANT_CLASS_SIZE,
+} NkFormatStringVariantClass;
+
+/* Object paths, signatures, handles and other containers are printed as is */
+static const guint8 _nk_format_string_variant_classes[G_MAXUINT8 + 1] = {
+    [G_VARIANT_CLASS_STRING] = NK_FORMAT_STRING_VARIANT_CLASS_STRING,
+    [G_VARIANT_CLASS_BOOLEAN] = NK_FORMAT_STRING_VARIANT_CLASS_BOOLEAN,
+    [G_VARIANT_CLASS_BYTE] = NK_FORMAT_STRING_VARIANT_CLASS_BYTE,
+    [G_VARIANT_CLASS_INT16] = NK_FORMAT_STRING_VARIANT_CLASS_INT16,
+    [G_VARIANT_CLASS_UINT16] = NK_FORMAT_STRING_VARIANT_CLASS_UINT16,
+    [G_VARIANT_CLASS_INT32] = NK_FORMAT_STRING_VARIANT_CLASS_INT32,
+    [G_VARIANT_CLASS_UINT32] = NK_FORMAT_STRING_VARIANT_CLASS_UINT32,
+    [G_VARIANT_CLASS_INT64] = NK_FORMAT_STRING_VARIANT_CLASS_INT64,
+    [G_VARIANT_CLASS_UINT64] = NK_FORMAT_STRING_VARIANT_CLASS_UINT64,
+    [G_VARIANT_CLASS_DOUBLE] = NK_FORMAT_STRING_VARIANT_CLASS_DOUBLE,
+    [G_VARIANT_CLASS_ARRAY] = NK_FORMAT_STRING_VARIANT_CLASS_ARRAY,
+    [G_VARIANT_CLASS_VARIANT] = NK_FORMAT_STRING_VARIANT_CLASS_VARIANT,
+};
+
+#define _nk_format_string_variant_class_from_char(c) ((NkFormatStringVariantClass) _nk_format_string_variant_classes[(guchar) (c)])
+#define _nk_format_string_variant_classify(variant) _nk_format_string_variant_class_from_char(g_variant_classify(variant))
+
+static gdouble
+_nk_format_string_variant_get_double_boolean(GVariant *var)
+{
+    return g_variant_get_boolean(var) ? 1 : 0;
+}
+
+#define _nk_format_string_variant_get_double_define(l) \
+    static gdouble \
+    _nk_format_string_variant_get_double_##l(GVariant *var) \
+    { \
+        return g_variant_get_##l(var); \
+    }
+
+_nk_format_string_variant_get_double_define(byte)
+_nk_format_string_variant_get_double_define(int16)
+_nk_format_string_variant_get_double_define(uint16)
+_nk_format_string_variant_get_double_define(int32)
+_nk_format_string_variant_get_double_define(uint32)
+_nk_format_string_variant_get_double_define(int64)
+_nk_format_string_variant_get_double_define(uint64)
+_nk_format_string_variant_get_double_define(double)
+
+#undef _nk_format_string_variant_get_double_define
+
+static gdouble (* const _nk_format_string_variant_get_double[NK_FORMAT_STRING_VARIANT_CLASS_SIZE])(GVariant *var) = {
+    [NK_FORMAT_STRING_VARIANT_CLASS_BOOLEAN] = _nk_format_string_variant_get_double_boolean,
+    [NK_FORMAT_STRING_VARIANT_CLASS_BYTE] = _nk_format_string_variant_get_double_byte,
+    [NK_FORMAT_STRING_VARIANT_CLASS_INT16] = _nk_format_string_variant_get_double_int16,
+    [NK_FORMAT_STRING_VARIANT_CLASS_UINT16] = _nk_format_string_variant_get_double_uint16,
+    [NK_FORMAT_STRING_VARIANT_CLASS_INT32] = _nk_format_string_variant_get_double_int32,
+    [NK_FORMAT_STRING_VARIANT_CLASS_UINT32] = _nk_format_string_variant_get_double_uint32,
+    [NK_FORMAT_STRING_VARIANT_CLASS_INT64] = _nk_format_string_variant_get_double_int64,
+    [NK_FORMAT_STRING_VARIANT_CLASS_UINT64] = _nk_format_string_variant_get_double_uint64,
+    [NK_FORMAT_STRING_VARIANT_CLASS_DOUBLE] = _nk_format_string_variant_get_double_double,
+};
+
 static gboolean
 _nk_format_string_double_from_variant(GVariant *var, gdouble *value, GError **error)
 {
-#define _nk_format_string_range_value_check_type(t, T, s) \
-    else if ( g_variant_is_of_type(var, G_VARIANT_TYPE_##T##s) ) \
-        *value = g_variant_get_##t##s(var)
-
-    if ( g_variant_is_of_type(var, G_VARIANT_TYPE_DOUBLE) )
-        *value = g_variant_get_double(var);
-    _nk_format_string_range_value_check_type(int, INT, 16);
-    _nk_format_string_range_value_check_type(int, INT, 32);
-    _nk_format_string_range_value_check_type(int, INT, 64);
-    _nk_format_string_range_value_check_type(uint, UINT, 16);
-    _nk_format_string_range_value_check_type(uint, UINT, 32);
-    _nk_format_string_range_value_check_type(uint, UINT, 64);
-    else if ( g_variant_is_of_type(var, G_VARIANT_TYPE_BYTE) )
-        *value = g_variant_get_byte(var);
-    else if ( g_variant_is_of_type(var, G_VARIANT_TYPE_BOOLEAN) )
-        *value = g_variant_get_boolean(var) ? 1 : 0;
-    else
+    gdouble (*get_double)(GVariant *var) = _nk_format_string_variant_get_double[_nk_format_string_variant_classify(var)];
+
+    if ( get_double == NULL )
     {
         g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_RANGE, "Invalid range value type: %s", g_variant_get_type_string(var));
         return FALSE;
     }
 
-#undef _nk_format_string_range_value_check_type
-
+    *value = get_double(var);
     return TRUE;
 }
 
@@ -309,59 +786,178 @@ _nk_format_string_search_enum_tokens(NkFormatString *self, const gchar * const *
         if ( used_tokens != NULL )
             *used_tokens |= (1 << self->tokens[i].value);
 
-        if ( self->tokens[i].fallback != NULL )
-            _nk_format_string_search_enum_tokens(self->tokens[i].fallback, tokens, size, used_tokens, error);
-        if ( self->tokens[i].substitute != NULL )
-            _nk_format_string_search_enum_tokens(self->tokens[i].substitute, tokens, size, used_tokens, error);
-        if ( self->tokens[i].replace != NULL )
+        const NkFormatStringTokenModifiers *modifiers = _nk_format_string_token_modifiers(&self->tokens[i]);
+        if ( modifiers->fallback != NULL )
+            _nk_format_string_search_enum_tokens(modifiers->fallback, tokens, size, used_tokens, error);
+        if ( modifiers->substitute != NULL )
+            _nk_format_string_search_enum_tokens(modifiers->substitute, tokens, size, used_tokens, error);
+        if ( modifiers->replace != NULL )
         {
             NkFormatStringRegex *regex;
-            for ( regex = self->tokens[i].replace ; regex->regex != NULL ; ++regex )
+            for ( regex = modifiers->replace ; regex->replacement != NULL ; ++regex )
                 _nk_format_string_search_enum_tokens(regex->replacement, tokens, size, used_tokens, error);
         }
     }
     return TRUE;
 }
 
-static NkFormatString *_nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GError **error);
+static NkFormatString *_nk_format_string_parse(NkFormatString *root, gboolean owned, gchar *string, gunichar identifier, GError **error);
+static void _nk_format_string_compile(NkFormatString *self);
 static NkFormatString *
-_nk_format_string_parse_enum(gboolean owned, gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *used_tokens, GError **error)
+_nk_format_string_parse_enum(NkFormatString *root, gboolean owned, gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *used_tokens, GError **error)
 {
     g_return_val_if_fail(string != NULL, NULL);
 
     NkFormatString *self;
 
-    self = _nk_format_string_parse(owned, string, identifier, error);
+    self = _nk_format_string_parse(root, owned, string, identifier, error);
     if ( self == NULL )
         return NULL;
 
     if ( _nk_format_string_search_enum_tokens(self, tokens, size, used_tokens, error) )
+    {
+        _nk_format_string_compile(self);
         return self;
+    }
 
     nk_format_string_unref(self);
     return NULL;
 }
 
+/* The default duration format is parsed once, and shared by all the tokens using it */
+static NkFormatString *
+_nk_format_string_prettify_duration_default_format(void)
+{
+    static NkFormatString *format = NULL;
+
+    if ( g_once_init_enter(&format) )
+    {
+        NkFormatString *default_format;
+        default_format = _nk_format_string_parse_enum(NULL, TRUE, g_strdup(NK_FORMAT_STRING_PRETTIFY_DURATION_DEFAULT), '%', _nk_format_string_prettify_duration_tokens, G_N_ELEMENTS(_nk_format_string_prettify_duration_tokens), NULL, NULL);
+        g_once_init_leave(&format, default_format);
+    }
+
+    return format;
+}
+
+/*
+ * Escapes split literals in several tokens, we merge them back.
+ * All the literals of a format string live in its buffer, in order,
+ * so we can move each of them right after the previous one.
+ * Empty literals are dropped.
+ */
+static void
+_nk_format_string_fold(NkFormatString *self)
+{
+    gchar *end = NULL;
+    gsize i, j = 0;
+    for ( i = 0 ; i < self->size ; ++i )
+    {
+        NkFormatStringToken *token = &self->tokens[i];
+        if ( token->string == NULL )
+        {
+            end = NULL;
+            self->tokens[j++] = *token;
+            continue;
+        }
+
+        gsize length = strlen(token->string);
+        if ( length == 0 )
+            continue;
+
+        if ( end != NULL )
+        {
+            memmove(end, token->string, length + 1);
+            end += length;
+            self->tokens[j - 1].length += length;
+            continue;
+        }
+
+        end = (gchar *) token->string + length;
+        token->length = length;
+        self->tokens[j++] = *token;
+    }
+    self->size = j;
+}
+
+static gboolean
+_nk_format_string_parse_slice_bound(const gchar **s, const gchar *e, gint64 *bound)
+{
+    const gchar *w = *s;
+    gchar *ie;
+
+    if ( ( w == e ) || ! ( g_ascii_isdigit(*w) || ( *w == '-' ) ) )
+        return TRUE;
+
+    errno = 0;
+    *bound = g_ascii_strtoll(w, &ie, 10);
+    if ( ( errno != 0 ) || ( ie == w ) || ( ie > e ) )
+        return FALSE;
+    *s = ie;
+    return TRUE;
+}
+
+/* A join key may end with a ;start:end slice, both bounds being optional */
+static gboolean
+_nk_format_string_parse_slice(const gchar *s, const gchar *e, NkFormatStringSlice *slice)
+{
+    NkFormatStringSlice r = {
+        .sliced = TRUE,
+        .start = 0,
+        .end = G_MAXINT64,
+    };
+
+    if ( ! _nk_format_string_parse_slice_bound(&s, e, &r.start) )
+        return FALSE;
+    if ( ( s == e ) || ( *s++ != ':' ) )
+        return FALSE;
+    if ( ! _nk_format_string_parse_slice_bound(&s, e, &r.end) )
+        return FALSE;
+    if ( s != e )
+        return FALSE;
+
+    *slice = r;
+    return TRUE;
+}
+
+/* Each identifier gives at most a literal and a reference */
+static gsize
+_nk_format_string_max_tokens(const gchar *string, gsize length, gunichar identifier)
+{
+    const gchar *w = string, *e = string + length;
+    gsize count = 0;
+
+    while ( ( w = _nk_format_string_utf8_strchr(w, e - w, identifier) ) != NULL )
+    {
+        ++count;
+        w = g_utf8_next_char(w);
+    }
+
+    return 2 * count + 1;
+}
+
 static NkFormatString *
-_nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GError **error)
+_nk_format_string_parse(NkFormatString *root, gboolean owned, gchar *string, gunichar identifier, GError **error)
 {
     g_return_val_if_fail(string != NULL, NULL);
     g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
+    gsize length = strlen(string);
+    gboolean have_identifier = ( identifier != '\0' );
+    if ( ! have_identifier )
+        identifier = '{';
+
     NkFormatString *self;
+    gsize allocated = _nk_format_string_max_tokens(string, length, identifier);
 
-    self = g_new0(NkFormatString, 1);
-    self->ref_count = 1;
+    self = _nk_format_string_new(root, _nk_format_string_arena_hint(allocated));
     self->owned = owned;
     self->string = string;
-    self->length = strlen(self->string);
-
-    gboolean have_identifier = ( identifier != '\0' );
-    if ( ! have_identifier )
-        identifier = '{';
+    self->length = length;
+    self->tokens = _nk_format_string_alloc(self, NkFormatStringToken, allocated);
 
     gchar *w = string;
-    while ( ( w = g_utf8_strchr(w, self->length - ( w - self->string ), identifier) ) != NULL )
+    while ( ( w = _nk_format_string_utf8_strchr(w, self->length - ( w - self->string ), identifier) ) != NULL )
     {
         gchar *b = w;
 
@@ -376,9 +972,7 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
                     NkFormatStringToken token = {
                         .string = string
                     };
-                    ++self->size;
-                    self->tokens = g_renew(NkFormatStringToken, self->tokens, self->size);
-                    self->tokens[self->size - 1] = token;
+                    self->tokens[self->size++] = token;
                 }
                 string = w = g_utf8_next_char(w);
                 continue;
@@ -393,19 +987,18 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
         NkFormatStringToken token = {
             .name = w
         };
+        NkFormatStringTokenModifiers modifiers = { .fallback = NULL };
 
-        /* References are alpha/-/_ only */
-        while ( g_unichar_isalpha(g_utf8_get_char(w)) || ( g_utf8_get_char(w) == '-' ) || ( g_utf8_get_char(w) == '_' ) )
-            w = g_utf8_next_char(w);
+        w = (gchar *) _nk_format_string_name_end(w, self->string + self->length);
 
         /* Empty name */
         if ( token.name == w )
             continue;
 
-        e = _nk_format_string_strchr_escape(w, self->length - ( w - self->string ), '}', '{');
+        gchar *next;
+        e = _nk_format_string_strchr_escape(w, self->length - ( w - self->string ), '}', '{', &next);
         if ( e == NULL )
             continue;
-        gchar *next = g_utf8_next_char(e);
 
         if ( ( w != e ) && ( g_utf8_get_char(w) == '[' ) )
         {
@@ -414,15 +1007,18 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
             const gchar *key = w;
             gint64 index = 0;
             if ( g_unichar_isalpha(g_utf8_get_char(w)) )
-            {
-                while ( g_unichar_isalpha(g_utf8_get_char(w)) || ( g_utf8_get_char(w) == '-' ) || ( g_utf8_get_char(w) == '_' ) )
-                    w = g_utf8_next_char(w);
-            }
+                w = (gchar *) _nk_format_string_name_end(w, e);
             else if ( g_utf8_get_char(w) == '@' )
             {
                 /* We consider the rest as a join token */
-                while ( g_utf8_get_char(w) != ']' )
-                    w = g_utf8_next_char(w);
+                if ( ( w = memchr(w, ']', e - w) ) == NULL )
+                    w = e;
+                else
+                {
+                    gchar *s = g_strrstr_len(key, w - key, ";");
+                    if ( ( s != NULL ) && _nk_format_string_parse_slice(s + 1, w, &modifiers.slice) )
+                        *s = '\0';
+                }
             }
             else
             {
@@ -452,7 +1048,8 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
             token.index = index;
         }
 
-        if ( w != e )
+        gboolean have_modifiers = ( w != e );
+        if ( have_modifiers )
         switch ( g_utf8_get_char(w) )
         {
         case ':':
@@ -464,25 +1061,25 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
             switch ( g_utf8_get_char(w) )
             {
             case '-':
-                token.fallback = _nk_format_string_parse(FALSE, g_utf8_next_char(w), identifier, error);
-                if ( token.fallback == NULL )
+                modifiers.fallback = _nk_format_string_parse(self->root, FALSE, g_utf8_next_char(w), identifier, error);
+                if ( modifiers.fallback == NULL )
                     goto fail;
             break;
             case '+':
-                token.substitute = _nk_format_string_parse(FALSE, g_utf8_next_char(w), identifier, error);
-                if ( token.substitute == NULL )
+                modifiers.substitute = _nk_format_string_parse(self->root, FALSE, g_utf8_next_char(w), identifier, error);
+                if ( modifiers.substitute == NULL )
                     goto fail;
             break;
             case '!':
                 token.no_data = TRUE;
-                token.fallback = _nk_format_string_parse(FALSE, g_utf8_next_char(w), identifier, error);
-                if ( token.fallback == NULL )
+                modifiers.fallback = _nk_format_string_parse(self->root, FALSE, g_utf8_next_char(w), identifier, error);
+                if ( modifiers.fallback == NULL )
                     goto fail;
             break;
             case '[':
             {
                 w = g_utf8_next_char(w);
-                e = _nk_format_string_strchr_escape(w, e - w, ']', '[');
+                e = _nk_format_string_strchr_escape(w, e - w, ']', '[', NULL);
                 if ( e == NULL )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_RANGE, "Missing range close bracket: %s", w);
@@ -494,42 +1091,51 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
                 gchar *s;
 
                 w = g_utf8_next_char(w);
-                if ( ( s = g_utf8_strchr(w, e - w, sep) ) == NULL )
+                if ( ( s = _nk_format_string_utf8_strchr(w, e - w, sep) ) == NULL )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_RANGE, "Missing range minimum value: %s", w);
                     goto fail;
                 }
-                if ( ! _nk_format_string_parse_range_value(w, s, &token.range.min, error) )
+                if ( ! _nk_format_string_parse_range_value(w, s, &modifiers.range.min, error) )
                     goto fail;
 
                 w = g_utf8_next_char(s);
-                if ( ( s = g_utf8_strchr(w, e - w, sep) ) == NULL )
+                if ( ( s = _nk_format_string_utf8_strchr(w, e - w, sep) ) == NULL )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_RANGE, "Missing range maximum value: %s", w);
                     goto fail;
                 }
-                if ( ! _nk_format_string_parse_range_value(w, s, &token.range.max, error) )
+                if ( ! _nk_format_string_parse_range_value(w, s, &modifiers.range.max, error) )
                     goto fail;
 
-                if ( token.range.min > token.range.max )
+                if ( modifiers.range.min > modifiers.range.max )
                 {
-                    g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_RANGE, "Range minimum value is bigger than the valueimum value: min=%lf > value=%lf", token.range.min, token.range.max);
+                    g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_RANGE, "Range minimum value is bigger than the valueimum value: min=%lf > value=%lf", modifiers.range.min, modifiers.range.max);
                     goto fail;
                 }
 
-                do
+                /* One value after each remaining separator */
+                gchar *v;
+                gsize count = 0;
+                for ( v = s ; v != NULL ; v = _nk_format_string_utf8_strchr(v, e - v, sep) )
+                {
+                    ++count;
+                    v = g_utf8_next_char(v);
+                }
+                modifiers.range.values = _nk_format_string_alloc(self, gchar *, count);
+
+                do
                 {
                     w = g_utf8_next_char(s);
                     *s = '\0';
-                    token.range.values = g_renew(gchar *, token.range.values, ++token.range.length);
-                    token.range.values[token.range.length - 1] = w;
-                } while ( ( s = g_utf8_strchr(w, e - w, sep) ) != NULL );
+                    modifiers.range.values[modifiers.range.length++] = w;
+                } while ( ( s = _nk_format_string_utf8_strchr(w, e - w, sep) ) != NULL );
             }
             break;
             case '{':
             {
                 w = g_utf8_next_char(w);
-                e = _nk_format_string_strchr_escape(w, e - w, '}', '{');
+                e = _nk_format_string_strchr_escape(w, e - w, '}', '{', NULL);
                 if ( e == NULL )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_SWITCH, "Missing switch close bracket: %s", w);
@@ -541,15 +1147,15 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
                 gchar *s;
 
                 w = g_utf8_next_char(w);
-                if ( ( s = g_utf8_strchr(w, e - w, sep) ) == NULL )
+                if ( ( s = _nk_format_string_utf8_strchr(w, e - w, sep) ) == NULL )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_SWITCH, "Missing switch false value: %s", w);
                     goto fail;
                 }
-                token.switch_.true_ = w;
+                modifiers.switch_.true_ = w;
                 w = g_utf8_next_char(s);
                 *s = '\0';
-                token.switch_.false_ = w;
+                modifiers.switch_.false_ = w;
             }
             break;
             default:
@@ -566,18 +1172,18 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
             gchar *m = w;
             w = g_utf8_next_char(w);
             *e = *m = '\0';
-            e = _nk_format_string_strchr_escape(w, e - w, ')', '(');
+            e = _nk_format_string_strchr_escape(w, e - w, ')', '(', NULL);
             if ( e == NULL )
             {
                 g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_PRETIFFY, "Missing prettify close paren: %s", w);
                 goto fail;
             }
             *e = '\0';
-            token.prettify.type = g_utf8_get_char(w);
-            token.prettify.width = 0;
-            token.prettify.precision = -1;
+            modifiers.prettify.type = g_utf8_get_char(w);
+            modifiers.prettify.width = 0;
+            modifiers.prettify.precision = -1;
             w = g_utf8_next_char(w);
-            switch ( token.prettify.type )
+            switch ( modifiers.prettify.type )
             {
             case NK_FORMAT_STRING_PRETTIFY_FLOAT:
             case NK_FORMAT_STRING_PRETTIFY_PREFIXES_SI:
@@ -585,14 +1191,18 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
             break;
             case NK_FORMAT_STRING_PRETTIFY_TIME:
                 if ( w != e )
-                    token.prettify.time_format = w;
+                    modifiers.prettify.time_format = w;
                 else
-                    token.prettify.time_format = "%c";
+                    modifiers.prettify.time_format = "%c";
+                modifiers.prettify.time_granularity = _nk_format_string_time_format_granularity(modifiers.prettify.time_format);
                 w = e;
                 goto end_prettify;
             case NK_FORMAT_STRING_PRETTIFY_DURATION:
-                token.prettify.duration_format = _nk_format_string_parse_enum(( w == e ), ( w == e ) ? g_strdup(NK_FORMAT_STRING_PRETTIFY_DURATION_DEFAULT) : w, '%', _nk_format_string_prettify_duration_tokens, G_N_ELEMENTS(_nk_format_string_prettify_duration_tokens), NULL, error);
-                if ( token.prettify.duration_format == NULL )
+                if ( w == e )
+                    modifiers.prettify.duration_format = nk_format_string_ref(_nk_format_string_prettify_duration_default_format());
+                else
+                    modifiers.prettify.duration_format = _nk_format_string_parse_enum(self->root, FALSE, w, '%', _nk_format_string_prettify_duration_tokens, G_N_ELEMENTS(_nk_format_string_prettify_duration_tokens), NULL, error);
+                if ( modifiers.prettify.duration_format == NULL )
                     goto fail;
                 w = e;
                 goto end_prettify;
@@ -612,18 +1222,16 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
 
             if ( g_utf8_get_char(w) == '0' )
             {
-                g_snprintf(token.prettify.format, sizeof(token.prettify.format), "%%0*.*lf%%s");
+                modifiers.prettify.zero = TRUE;
                 w = g_utf8_next_char(w);
             }
-            else
-                g_snprintf(token.prettify.format, sizeof(token.prettify.format), "%%*.*lf%%s");
             if ( w == e )
                 break;
             if ( g_unichar_isdigit(g_utf8_get_char(w)) )
             {
                 gchar *ie;
                 errno = 0;
-                token.prettify.width = g_ascii_strtoll(w, &ie, 10);
+                modifiers.prettify.width = g_ascii_strtoll(w, &ie, 10);
                 if ( ( errno != 0 ) || ( w == ie ) )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_PRETIFFY, "Could not parse pretiffy width: %s", w);
@@ -637,7 +1245,7 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
                 w = g_utf8_next_char(w);
                 gchar *ie;
                 errno = 0;
-                token.prettify.precision = g_ascii_strtoll(w, &ie, 10);
+                modifiers.prettify.precision = g_ascii_strtoll(w, &ie, 10);
                 if ( ( errno != 0 ) || ( w == ie ) )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_PRETIFFY, "Could not parse pretiffy precision: %s", w);
@@ -660,20 +1268,36 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
             *e = '\0';
 
             gsize c = 0;
+            gchar *l;
             do
             {
                 ++c;
                 *m = '\0';
-            } while ( ( m = _nk_format_string_strchr_escape(m, e - m, '/', '\0') ) != NULL );
+                l = m;
+            } while ( ( m = _nk_format_string_strchr_escape(m, e - m, '/', '\0', NULL) ) != NULL );
             c = ( c + 1 ) / 2 + 1;
+            /* Unescaping may have moved the end */
+            e = l + 1 + strlen(l + 1);
 
-            token.replace = g_new(NkFormatStringRegex, c);
+            modifiers.replace = _nk_format_string_alloc(self, NkFormatStringRegex, c);
             c = 0;
             do
             {
                 GError *_inner_error_ = NULL;
-                token.replace[c].regex = g_regex_new(++w, G_REGEX_OPTIMIZE, 0, &_inner_error_);
-                if ( token.replace[c].regex == NULL )
+                modifiers.replace[c].pattern = ++w;
+                modifiers.replace[c].flags = G_REGEX_OPTIMIZE;
+                modifiers.replace[c].regex = NULL;
+                modifiers.replace[c].length = 0;
+                if ( _nk_format_string_regex_is_literal(w, modifiers.replace[c].flags) )
+                {
+                    if ( ! g_utf8_validate(w, -1, NULL) )
+                    {
+                        g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_REGEX, "Wrong regex: invalid UTF-8: %s", w);
+                        goto fail;
+                    }
+                    modifiers.replace[c].length = strlen(w);
+                }
+                else if ( ( modifiers.replace[c].regex = g_regex_new(w, modifiers.replace[c].flags, 0, &_inner_error_) ) == NULL )
                 {
                     g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_REGEX, "Wrong regex: %s", _inner_error_->message);
                     g_clear_error(&_inner_error_);
@@ -681,13 +1305,16 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
                 }
 
                 w = w + strlen(w) + 1;
-                token.replace[c].replacement = _nk_format_string_parse(FALSE, ( w > e ) ? "" : w, identifier, error);
-                if ( token.replace[c].replacement == NULL )
+                /* Parsing will write in the replacement string */
+                gchar *n = ( w > e ) ? w : ( w + strlen(w) );
+                modifiers.replace[c].replacement = _nk_format_string_parse(self->root, FALSE, ( w > e ) ? "" : w, identifier, error);
+                if ( modifiers.replace[c].replacement == NULL )
                     goto fail;
-                w += strlen(w);
+                w = n;
                 ++c;
             } while ( w < e );
-            token.replace[c].regex = NULL;
+            modifiers.replace[c].regex = NULL;
+            modifiers.replace[c].replacement = NULL;
         }
         break;
         default:
@@ -696,26 +1323,28 @@ _nk_format_string_parse(gboolean owned, gchar *string, gunichar identifier, GErr
 
         *e = *b = '\0';
 
-        ++self->size;
-        if ( *string != '\0' )
-            ++self->size;
-        self->tokens = g_renew(NkFormatStringToken, self->tokens, self->size);
+        if ( have_modifiers || modifiers.slice.sliced )
+        {
+            token.modifiers = _nk_format_string_alloc(self, NkFormatStringTokenModifiers, 1);
+            *token.modifiers = modifiers;
+        }
         if ( *string != '\0' )
         {
             NkFormatStringToken stoken = {
                 .string = string
             };
-            self->tokens[self->size - 2] = stoken;
+            self->tokens[self->size++] = stoken;
         }
-        self->tokens[self->size - 1] = token;
+        self->tokens[self->size++] = token;
 
         string = w = next;
     }
-    self->tokens = g_renew(NkFormatStringToken, self->tokens, ++self->size);
     NkFormatStringToken token = {
         .string = string
     };
-    self->tokens[self->size - 1] = token;
+    self->tokens[self->size++] = token;
+
+    _nk_format_string_fold(self);
 
     return self;
 
@@ -724,588 +1353,3928 @@ fail:
     return NULL;
 }
 
-/**
- * nk_format_string_parse:
- * @string: (transfer full): a format string
- * @identifier: the reference identifier character (e.g. '$')
- * @error: return location for a #GError, or %NULL
- *
- * Parses @string
- *
- * Returns: (transfer full): an #NkFormatString, %NULL on error
- */
-NK_EXPORT NkFormatString *
-nk_format_string_parse(gchar *string, gunichar identifier, GError **error)
-{
-    return _nk_format_string_parse(TRUE, string, identifier, error);
-}
-
-/**
- * nk_format_string_parse_enum:
- * @string: (transfer full): a format string
- * @identifier: the reference identifier character (e.g. '$')
- * @tokens: (array length=size): a list of tokens
- * @size: the size of @tokens
- * @used_tokens: (out) (nullable): return location for the used tokens mask
- * @error: return location for a #GError, or %NULL
- *
- * Parses @string as nk_format_string_parse().
- *
- * Once parsed, each reference is checked against @tokens
- *
- * If @used_tokens is non-%NULL, @size must be inferior or equal to 64.
- *
- * If the function returns an #NkFormatString, @used_tokens is filled with a bitfield
- * corresponding to all used tokens. Each bit set to 1 at position `x` (`1 << x`)
- * means the token `x` was used.
- *
- * If the function returns %NULL, @used_tokens is left untouched.
- *
- * Returns: (transfer full): an #NkFormatString, %NULL on error
- */
-NK_EXPORT NkFormatString *
-nk_format_string_parse_enum(gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *ret_used_tokens, GError **error)
-{
-    g_return_val_if_fail(ret_used_tokens == NULL || size <= 64, NULL);
+#define _nk_format_string_span_get_char(w, e) ( ( (w) < (e) ) ? g_utf8_get_char(w) : '\0' )
 
-    guint64 used_tokens = 0;
-    NkFormatString *self;
-    self = _nk_format_string_parse_enum(TRUE, string, identifier, tokens, size, ( ret_used_tokens != NULL ) ? &used_tokens : NULL, error);
-    if ( self == NULL )
-        return NULL;
-    if ( ret_used_tokens != NULL )
-        *ret_used_tokens = used_tokens;
-    return self;
-}
+typedef struct {
+    gsize offset;
+    gsize length;
+    gboolean reference;
+} NkFormatStringSpan;
 
-/**
- * nk_format_string_ref:
- * @format_string: an #NkFormatString
- *
- * Increments the reference counter of @format_string.
- *
- * Returns: (transfer full): the #NkFormatString
+/*
+ * Parsing from a constant string, which we must not touch.
+ * Literals are kept as spans of the source and only reference
+ * bodies (which are parsed in place) are copied to our own buffer.
+ * Escapes split literals: those are copied to be merged back.
  */
-NK_EXPORT NkFormatString *
-nk_format_string_ref(NkFormatString *self)
+static NkFormatString *
+_nk_format_string_parse_const(const gchar *source, gsize length, gunichar identifier, GError **error)
 {
-    g_return_val_if_fail(self != NULL, NULL);
-    ++self->ref_count;
-    return self;
-}
+    const gchar *e = source + length;
+    GArray *spans;
+    gsize i;
 
-static void
-_nk_format_string_free(NkFormatString *self)
-{
-    if ( self->owned )
-        g_free(self->string);
+    spans = g_array_new(FALSE, FALSE, sizeof(NkFormatStringSpan));
 
-    gsize i;
-    for ( i = 0 ; i < self->size ; ++i )
+    gboolean have_identifier = ( identifier != '\0' );
+    gunichar search = have_identifier ? identifier : '{';
+
+    const gchar *string = source;
+    const gchar *w = source;
+    while ( ( w = _nk_format_string_utf8_strchr(w, e - w, search) ) != NULL )
     {
-        if ( self->tokens[i].substitute != NULL)
-            _nk_format_string_free(self->tokens[i].substitute);
-        else if ( self->tokens[i].range.length > 0 )
-            g_free(self->tokens[i].range.values);
-        else if ( self->tokens[i].replace != NULL )
+        const gchar *b = w;
+
+        if ( have_identifier )
         {
-            NkFormatStringRegex *regex;
-            for ( regex = self->tokens[i].replace ; regex->regex != NULL ; ++regex )
+            w = g_utf8_next_char(w);
+            if ( _nk_format_string_span_get_char(w, e) == identifier )
             {
-                g_regex_unref(regex->regex);
-                _nk_format_string_free(regex->replacement);
+                NkFormatStringSpan span = {
+                    .offset = string - source,
+                    .length = w - string,
+                };
+                g_array_append_val(spans, span);
+                string = w = g_utf8_next_char(w);
+                continue;
             }
-            g_free(self->tokens[i].replace);
-        }
-        else if ( self->tokens[i].fallback != NULL )
-            _nk_format_string_free(self->tokens[i].fallback);
-    }
 
-    g_free(self->tokens);
+            if ( _nk_format_string_span_get_char(w, e) != '{' )
+                continue;
+        }
 
-    g_free(self);
-}
+        w = g_utf8_next_char(w);
+        const gchar *name = w;
 
-/**
- * nk_format_string_unref:
- * @format_string: an #NkFormatString
- *
- * Decrements the reference counter of @format_string.
- * If it reaches 0, free @format_string.
- */
-NK_EXPORT void
-nk_format_string_unref(NkFormatString *self)
-{
-    g_return_if_fail(self != NULL);
-    if ( --self->ref_count > 0 )
-        return;
+        w = _nk_format_string_name_end(w, e);
 
-    _nk_format_string_free(self);
-}
+        /* Empty name */
+        if ( name == w )
+            continue;
 
-static GVariant *
-_nk_format_string_search_data(GVariant *source, const gchar *key, gint64 index, const gchar **joiner)
-{
-    if ( source == NULL )
-        return NULL;
+        const gchar *te = _nk_format_string_strchr_escape_const(w, e, '}', '{', NULL);
+        if ( te == NULL )
+            continue;
+        const gchar *next = g_utf8_next_char(te);
 
-    GVariant *data = source;
-    while ( g_variant_is_of_type(data, G_VARIANT_TYPE_VARIANT) )
-        data = g_variant_get_variant(data);
+        if ( b > string )
+        {
+            NkFormatStringSpan span = {
+                .offset = string - source,
+                .length = b - string,
+            };
+            g_array_append_val(spans, span);
+        }
+        NkFormatStringSpan span = {
+            .offset = b - source,
+            .length = next - b,
+            .reference = TRUE,
+        };
+        g_array_append_val(spans, span);
 
-    if ( g_variant_is_of_type(data, G_VARIANT_TYPE_DICTIONARY) )
-    {
-        if ( ( key == NULL ) || ( g_utf8_get_char(key) == '\0' ) )
-            data = NULL;
-        else
-            data = g_variant_lookup_value(data, key, NULL);
+        string = w = next;
     }
-    else if ( g_variant_is_of_type(data, G_VARIANT_TYPE_ARRAY) )
+    if ( e > string )
     {
-        gsize length;
-        length = g_variant_n_children(data);
+        NkFormatStringSpan span = {
+            .offset = string - source,
+            .length = e - string,
+        };
+        g_array_append_val(spans, span);
+    }
 
-        if ( length == 0 )
-            data = NULL;
-        else if ( key != NULL )
-        switch ( g_utf8_get_char(key) )
-        {
-        case '\0':
+    NkFormatStringSpan *span, *spans_end = &g_array_index(spans, NkFormatStringSpan, spans->len);
+
+    /* Compute our buffer size first, we must not move it later */
+    gsize size = 0;
+    for ( span = &g_array_index(spans, NkFormatStringSpan, 0) ; span < spans_end ; ++span )
+    {
+        if ( span->reference )
+            size += span->length + 1;
+        else if ( ( ( span + 1 ) < spans_end ) && ( ! span[1].reference ) )
         {
-            gsize i = ABS(index);
-            if ( ( index < 0 ) && ( i <= length ) )
-                data = g_variant_get_child_value(data, length - i);
-            else if ( ( index >= 0 ) && ( i < length ) )
-                data = g_variant_get_child_value(data, i);
-            else
-                data = NULL;
+            for ( ; ( span < spans_end ) && ( ! span->reference ) ; ++span )
+                size += span->length;
+            ++size;
+            --span;
         }
-        break;
-        case '@':
+    }
+
+    NkFormatString *self, **references;
+    gsize allocated = 0;
+    self = _nk_format_string_new(NULL, _nk_format_string_arena_align(size) + _nk_format_string_arena_hint(spans->len));
+    self->string = ( size > 0 ) ? _nk_format_string_alloc(self, gchar, size) : NULL;
+    self->length = length;
+
+    /* References are parsed first, to know how many tokens we need */
+    references = g_new0(NkFormatString *, spans->len);
+    gchar *buffer = self->string;
+    for ( span = &g_array_index(spans, NkFormatStringSpan, 0) ; span < spans_end ; ++span )
+    {
+        if ( ! span->reference )
         {
-            const gchar *s = g_utf8_next_char(key);
-            if ( g_utf8_get_char(s) != '\0')
-                *joiner = s;
+            if ( ( ( span + 1 ) < spans_end ) && ( ! span[1].reference ) )
+            {
+                for ( ; ( span < spans_end ) && ( ! span->reference ) ; ++span )
+                    buffer += span->length;
+                ++buffer;
+                --span;
+            }
+            ++allocated;
+            continue;
         }
-        break;
-        default:
-            data = NULL;
+
+        NkFormatString *reference;
+        memcpy(buffer, source + span->offset, span->length);
+        buffer[span->length] = '\0';
+        reference = _nk_format_string_parse(self, FALSE, buffer, identifier, error);
+        buffer += span->length + 1;
+        if ( reference == NULL )
+            goto fail;
+        references[span - &g_array_index(spans, NkFormatStringSpan, 0)] = reference;
+        allocated += reference->size;
+    }
+
+    self->tokens = _nk_format_string_alloc(self, NkFormatStringToken, allocated);
+    buffer = self->string;
+    for ( span = &g_array_index(spans, NkFormatStringSpan, 0) ; span < spans_end ; ++span )
+    {
+        if ( ! span->reference )
+        {
+            NkFormatStringToken token = {
+                .string = source + span->offset,
+                .length = span->length,
+            };
+            if ( ( ( span + 1 ) < spans_end ) && ( ! span[1].reference ) )
+            {
+                token.string = buffer;
+                token.length = 0;
+                for ( ; ( span < spans_end ) && ( ! span->reference ) ; ++span )
+                {
+                    memcpy(buffer, source + span->offset, span->length);
+                    buffer += span->length;
+                    token.length += span->length;
+                }
+                *buffer++ = '\0';
+                --span;
+            }
+            self->tokens[self->size++] = token;
+            continue;
         }
+
+        /* We steal the tokens, the strings are in our buffer */
+        NkFormatString *reference = references[span - &g_array_index(spans, NkFormatStringSpan, 0)];
+        buffer += span->length + 1;
+        for ( i = 0 ; i < reference->size ; ++i )
+            self->tokens[self->size++] = reference->tokens[i];
     }
 
-    if ( data != NULL )
+    g_free(references);
+    g_array_free(spans, TRUE);
+
+    return self;
+
+fail:
+    /* Their tokens are not ours yet */
+    for ( i = 0 ; i < spans->len ; ++i )
     {
-        while ( g_variant_is_of_type(data, G_VARIANT_TYPE_VARIANT) )
-            data = g_variant_get_variant(data);
+        if ( references[i] != NULL )
+            nk_format_string_unref(references[i]);
+    }
+    g_free(references);
+    g_array_free(spans, TRUE);
+    nk_format_string_unref(self);
+    return NULL;
+}
+
+#undef _nk_format_string_span_get_char
+
+static gsize
+_nk_format_string_compile_op(GArray *program, NkFormatStringOpCode code, gconstpointer data)
+{
+    NkFormatStringOp op = {
+        .code = code,
+        .string = data,
+    };
+    g_array_append_val(program, op);
+    return program->len - 1;
+}
 
-        g_variant_ref(data);
+static gsize
+_nk_format_string_compile_reference(GArray *references, const NkFormatStringToken *token)
+{
+    gsize i;
+    for ( i = 0 ; i < references->len ; ++i )
+    {
+        if ( g_strcmp0(g_array_index(references, NkFormatStringReference, i).name, token->name) == 0 )
+            return i;
     }
-    g_variant_unref(source);
-    return data;
+
+    NkFormatStringReference reference = {
+        .name = token->name,
+        .value = token->value,
+    };
+    g_array_append_val(references, reference);
+    return references->len - 1;
 }
 
+#define _nk_format_string_program_op(program, i) (&g_array_index(program, NkFormatStringOp, i))
+
+/*
+ * A reference is provably empty when it outputs nothing both with and
+ * without data (e.g. `${reference:+}`), so we can skip it entirely.
+ * Sub-formats are already folded, an empty one has no token.
+ */
 static gboolean
-_nk_format_string_check_data(GVariant *data, const NkFormatStringToken *part)
+_nk_format_string_token_is_empty(const NkFormatStringToken *token)
 {
-    if ( data == NULL )
+    const NkFormatStringTokenModifiers *modifiers = _nk_format_string_token_modifiers(token);
+
+    if ( ( modifiers->fallback != NULL ) && ( modifiers->fallback->size > 0 ) )
         return FALSE;
 
-    if ( g_variant_is_of_type(data, G_VARIANT_TYPE_BOOLEAN) )
+    if ( modifiers->substitute != NULL )
+        return ( modifiers->substitute->size == 0 );
+    if ( modifiers->range.length > 0 )
     {
-        /* We want a boolean data to still be replaced if it’s not checked against */
-        if ( ! g_variant_get_boolean(data) )
-            return ( ( part->fallback == NULL ) && ( part->substitute == NULL ) );
+        gsize i;
+        for ( i = 0 ; i < modifiers->range.length ; ++i )
+        {
+            if ( *modifiers->range.values[i] != '\0' )
+                return FALSE;
+        }
+        return TRUE;
     }
-
-    return TRUE;
+    if ( modifiers->switch_.true_ != NULL )
+        return ( ( *modifiers->switch_.true_ == '\0' ) && ( *modifiers->switch_.false_ == '\0' ) );
+    return token->no_data;
 }
 
-static void _nk_format_string_replace(GString *string, const NkFormatString *self, NkFormatStringReplaceReferenceCallback callback, gpointer user_data);
+typedef struct {
+    const gchar *pattern;
+    gsize pattern_length;
+    const gchar *replacement;
+    gsize replacement_length;
+} NkFormatStringRegexChainStage;
 
-static void
-_nk_format_string_append_range(GString *string, GVariant *data, NkFormatStringRange *range)
-{
-    gdouble value;
-    if ( ! _nk_format_string_double_from_variant(data, &value, NULL) )
-        return;
+/*
+ * A chain of literal patterns with literal replacements,
+ * applied in one scan (see _nk_format_string_regex_chain_new()).
+ * first maps the first byte of each pattern to its stage, plus one.
+ */
+struct _NkFormatStringRegexChain {
+    guint8 first[256];
+    gsize size;
+    NkFormatStringRegexChainStage stages[];
+};
 
-    gdouble v, r;
-    gsize i;
+#define NK_FORMAT_STRING_REGEX_CHAIN_MAX_SIZE 255
 
-    if ( value >= range->max )
-        i = range->length - 1;
-    else if ( value < range->min )
-        i = 0;
-    else
+/* Only a single literal (or nothing) is a literal replacement */
+static gboolean
+_nk_format_string_regex_replacement_is_literal(const NkFormatString *replacement, const gchar **string, gsize *length)
+{
+    const NkFormatStringOp *op = replacement->program;
+
+    *string = "";
+    *length = 0;
+    if ( op->code == NK_FORMAT_STRING_OP_LITERAL )
     {
-        v = value - range->min;
-        r = range->max - range->min;
-        i = (gsize) ( (gdouble) ( range->length ) * ( v / r ) );
+        *string = op->string;
+        *length = op->length;
+        ++op;
     }
-    g_string_append(string, range->values[i]);
+    if ( op->code != NK_FORMAT_STRING_OP_END )
+        return FALSE;
+
+    /* Escapes or references in the replacement */
+    return ( memchr(*string, '\\', *length) == NULL );
 }
 
 static void
-_nk_format_string_append_switch(GString *string, GVariant *data, NkFormatStringSwitch *switch_)
+_nk_format_string_regex_chain_bytes(const gchar *s, gsize length, gboolean *bytes)
 {
-    if ( ! g_variant_is_of_type(data, G_VARIANT_TYPE_BOOLEAN) )
-        return;
-
-    g_string_append(string, g_variant_get_boolean(data) ? switch_->true_ : switch_->false_);
+    const gchar *e = s + length;
+    for ( ; s < e ; ++s )
+        bytes[(guchar) *s] = TRUE;
 }
 
-static GVariant *
-_nk_format_string_prettify_duration_callback(G_GNUC_UNUSED const gchar *name, guint64 value, gpointer user_data)
+/*
+ * Regexes are applied in order, each on the result of the previous one.
+ * With literal patterns, this is the same as applying them all at once,
+ * as long as no match can depend on another one:
+ * - patterns have no byte in common, so their matches never overlap;
+ * - a replacement has no byte in common with the following patterns,
+ *   and is not empty (unless it is the last one), so that no later match
+ *   can use (or span) its output.
+ */
+static NkFormatStringRegexChain *
+_nk_format_string_regex_chain_new(NkFormatString *self, const NkFormatStringRegex *regex)
 {
-    NkFormatStringPrettifyDurationData *data = user_data;
-    switch ( (NkFormatStringPrettifyDurationToken) value )
+    const NkFormatStringRegex *r;
+    gsize size = 0;
+
+    for ( r = regex ; r->replacement != NULL ; ++r )
     {
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_WEEKS:
-        if ( data->w == 0 )
-            return NULL;
-        return g_variant_new_uint64(data->w);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_DAYS:
-        if ( data->d == 0 )
-            return NULL;
-        return g_variant_new_uint64(data->d);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_HOURS:
-        if ( data->h == 0 )
-            return NULL;
-        return g_variant_new_uint64(data->h);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_MINUTES:
-        if ( data->m == 0 )
+        if ( ! _nk_format_string_regex_is_literal(r->pattern, r->flags) )
             return NULL;
-        return g_variant_new_uint64(data->m);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_SECONDS:
-        if ( data->s == 0 )
-            return NULL;
-        return g_variant_new_uint64(data->s);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_MILLISECONDS:
-        if ( data->ms == 0 )
-            return NULL;
-        return g_variant_new_uint16(data->ms);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_MICROSECONDS:
-        if ( data->us == 0 )
-            return NULL;
-        return g_variant_new_uint16(data->us);
-    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_NANOSECONDS:
-        if ( data->ns == 0 )
-            return NULL;
-        return g_variant_new_uint16(data->ns);
+        ++size;
     }
-    return NULL;
-}
+    if ( size > NK_FORMAT_STRING_REGEX_CHAIN_MAX_SIZE )
+        return NULL;
 
-static const gchar *_nk_format_string_prefixes_si_big[] = {
-    "", "k", "M", "G", "T", "P", "E"
-};
-static const gchar *_nk_format_string_prefixes_si_small[] = {
-    "", "m", "µ", "n", "p", "f", "a"
-};
-static const gchar *_nk_format_string_prefixes_binary[] = {
-    "", "Ki", "Mi", "Gi", "Ti"
-};
+    NkFormatStringRegexChain *chain;
+    gboolean patterns[256] = { FALSE };
+    gsize i;
 
-static void
-_nk_format_string_append_prettify(GString *string, GVariant *data, NkFormatStringPrettify *prettify)
-{
-    gdouble number_value = 0;
-    const gchar *string_value = NULL;
-    switch ( _nk_format_string_prettify_inputs[prettify->type] )
+    chain = _nk_format_string_arena_alloc(&self->root->arena, sizeof(NkFormatStringRegexChain) + size * sizeof(NkFormatStringRegexChainStage));
+    chain->size = size;
+
+    /* Going backwards, we check each stage against the following ones */
+    for ( i = size ; i > 0 ; --i )
     {
-    case NK_FORMAT_STRING_PRETTIFY_INPUT_NONE:
-        g_return_if_reached();
-    case NK_FORMAT_STRING_PRETTIFY_INPUT_NUMBER:
-        if ( ! _nk_format_string_double_from_variant(data, &number_value, NULL) )
-            return;
-    break;
-    case NK_FORMAT_STRING_PRETTIFY_INPUT_STRING:
-        string_value = g_variant_get_string(data, NULL);
-    break;
+        NkFormatStringRegexChainStage *stage = &chain->stages[i - 1];
+        gsize j;
+
+        stage->pattern = regex[i - 1].pattern;
+        stage->pattern_length = strlen(stage->pattern);
+        if ( ! _nk_format_string_regex_replacement_is_literal(regex[i - 1].replacement, &stage->replacement, &stage->replacement_length) )
+            goto fail;
+        if ( ( stage->replacement_length == 0 ) && ( i < size ) )
+            goto fail;
+
+        for ( j = 0 ; j < stage->replacement_length ; ++j )
+        {
+            if ( patterns[(guchar) stage->replacement[j]] )
+                goto fail;
+        }
+        for ( j = 0 ; j < stage->pattern_length ; ++j )
+        {
+            if ( patterns[(guchar) stage->pattern[j]] )
+                goto fail;
+        }
+        _nk_format_string_regex_chain_bytes(stage->pattern, stage->pattern_length, patterns);
+        chain->first[(guchar) *stage->pattern] = i;
     }
 
-    switch ( prettify->type )
-    {
-    case NK_FORMAT_STRING_PRETTIFY_NONE:
-        g_return_if_reached();
-    case NK_FORMAT_STRING_PRETTIFY_FLOAT:
+    return chain;
+
+fail:
+    /* Left to the arena */
+    return NULL;
+}
+
+/*
+ * Literal patterns are searched with memchr() for their first byte,
+ * which the C library vectorizes, and checked with memcmp()
+ */
+static const gchar *
+_nk_format_string_literal_find(const gchar *s, const gchar *e, const gchar *pattern, gsize length)
+{
+    while ( (gsize) ( e - s ) >= length )
     {
-        gint precision = prettify->precision;
-        if ( number_value == (gdouble) ( (gint64) number_value ) )
-            precision = MAX(0, precision);
-        g_string_append_printf(string, prettify->format, prettify->width, precision, number_value, "");
+        s = memchr(s, *pattern, ( e - s ) - length + 1);
+        if ( s == NULL )
+            return NULL;
+        if ( memcmp(s + 1, pattern + 1, length - 1) == 0 )
+            return s;
+        ++s;
     }
-    break;
-    case NK_FORMAT_STRING_PRETTIFY_PREFIXES_SI:
+    return NULL;
+}
+
+static void
+_nk_format_string_literal_replace(GString *string, const gchar *s, gsize length, const gchar *pattern, gsize pattern_length, const gchar *replacement, gsize replacement_length)
+{
+    const gchar *e = s + length, *m;
+
+    while ( ( m = _nk_format_string_literal_find(s, e, pattern, pattern_length) ) != NULL )
     {
-        const gchar **prefix;
-        if ( number_value == 0 )
-            prefix = _nk_format_string_prefixes_si_small; /* Empty string */
-        else if ( ( number_value > -1 ) && ( number_value < 1 ) )
-        {
-            for ( prefix = _nk_format_string_prefixes_si_small ; ( number_value > -1 ) && ( number_value < 1 ) && ( prefix < ( _nk_format_string_prefixes_si_small + G_N_ELEMENTS(_nk_format_string_prefixes_si_small) ) ) ; ++prefix )
-                number_value *= 1000;
-        }
-        else for ( prefix = _nk_format_string_prefixes_si_big ; ( number_value >= 1000 ) && ( prefix < ( _nk_format_string_prefixes_si_big + G_N_ELEMENTS(_nk_format_string_prefixes_si_big) ) ) ; ++prefix )
-            number_value /= 1000;
-        gint precision = prettify->precision;
-        if ( number_value == (gdouble) ( (gint64) number_value ) )
-            precision = MAX(0, precision);
-        g_string_append_printf(string, prettify->format, prettify->width, precision, number_value, *prefix);
+        g_string_append_len(string, s, m - s);
+        g_string_append_len(string, replacement, replacement_length);
+        s = m + pattern_length;
     }
-    break;
-    case NK_FORMAT_STRING_PRETTIFY_PREFIXES_BINARY:
+    g_string_append_len(string, s, e - s);
+}
+
+static void
+_nk_format_string_regex_chain_run(GString *string, const NkFormatStringRegexChain *chain, const gchar *s, gsize length)
+{
+    if ( chain->size == 1 )
     {
-        const gchar **prefix;
-        for ( prefix = _nk_format_string_prefixes_binary ; ( number_value >= 1024 ) && ( prefix < ( _nk_format_string_prefixes_binary + G_N_ELEMENTS(_nk_format_string_prefixes_binary) ) ) ; ++prefix )
-            number_value /= 1024;
-        gint precision = prettify->precision;
-        if ( number_value == (gdouble) ( (gint64) number_value ) )
-            precision = MAX(0, precision);
-        g_string_append_printf(string, prettify->format, prettify->width, precision, number_value, *prefix);
+        const NkFormatStringRegexChainStage *stage = &chain->stages[0];
+        _nk_format_string_literal_replace(string, s, length, stage->pattern, stage->pattern_length, stage->replacement, stage->replacement_length);
+        return;
     }
-    break;
-    case NK_FORMAT_STRING_PRETTIFY_TIME:
+
+    const gchar *w = s, *e = s + length;
+
+    while ( w < e )
     {
-        GDateTime *time;
-        gchar *tmp = NULL;
-        time = g_date_time_new_from_unix_local(number_value);
-        if ( time != NULL )
+        guint8 i = chain->first[(guchar) *w];
+        if ( G_LIKELY(i == 0) )
         {
-            tmp = g_date_time_format(time, prettify->time_format);
-            g_date_time_unref(time);
+            ++w;
+            continue;
         }
-        if ( tmp != NULL )
-            g_string_append(string, tmp);
-        g_free(tmp);
-    }
-    break;
-    case NK_FORMAT_STRING_PRETTIFY_DURATION:
-    {
-        NkFormatStringPrettifyDurationData data = { .w = 0 };
-        guint64 s = (guint64) number_value;
-        number_value -= s;
 
-        if ( s > 604800 )
+        const NkFormatStringRegexChainStage *stage = &chain->stages[i - 1];
+        if ( ( (gsize) ( e - w ) < stage->pattern_length ) || ( memcmp(w, stage->pattern, stage->pattern_length) != 0 ) )
         {
-            data.w = s / 604800;
-            s %= 604800;
+            ++w;
+            continue;
         }
 
-        if ( s > 86400 )
+        g_string_append_len(string, s, w - s);
+        g_string_append_len(string, stage->replacement, stage->replacement_length);
+        s = w = w + stage->pattern_length;
+    }
+    g_string_append_len(string, s, e - s);
+}
+
+static void _nk_format_string_compile_program(NkFormatString *self, GArray *references, GArray *segments);
+static void
+_nk_format_string_compile_tokens(GArray *program, GArray *references, GArray *segments, NkFormatString *self)
+{
+    gsize i;
+    for ( i = 0 ; i < self->size ; ++i )
+    {
+        NkFormatStringToken *token = &self->tokens[i];
+
+        if ( ( token->string == NULL ) && _nk_format_string_token_is_empty(token) )
         {
-            data.d = s / 86400;
-            s %= 86400;
+            /* Keep it in the references list anyway */
+            _nk_format_string_compile_reference(references, token);
+            continue;
         }
 
-        if ( s > 3600 )
+        if ( segments != NULL )
         {
-            data.h = s / 3600;
-            s %= 3600;
+            gsize start = program->len;
+            g_array_append_val(segments, start);
         }
 
-        if ( s > 60 )
+        if ( token->string != NULL )
         {
-            data.m = s / 60;
-            s %= 60;
+            gsize op = _nk_format_string_compile_op(program, NK_FORMAT_STRING_OP_LITERAL, token->string);
+            _nk_format_string_program_op(program, op)->length = token->length;
+            continue;
         }
 
-        data.s = s;
-
-        if ( number_value >= 0.001 )
+        NkFormatStringTokenModifiers *modifiers = token->modifiers;
+        NkFormatStringOpCode code;
+        if ( modifiers == NULL )
+            code = token->no_data ? NK_FORMAT_STRING_OP_DROP : NK_FORMAT_STRING_OP_DATA;
+        else if ( modifiers->substitute != NULL )
+            code = NK_FORMAT_STRING_OP_DROP;
+        else if ( modifiers->range.length > 0 )
+            code = NK_FORMAT_STRING_OP_RANGE;
+        else if ( modifiers->switch_.true_ != NULL )
+            code = NK_FORMAT_STRING_OP_SWITCH;
+        else if ( modifiers->prettify.type != NK_FORMAT_STRING_PRETTIFY_NONE )
+            code = NK_FORMAT_STRING_OP_PRETTIFY;
+        else if ( modifiers->replace != NULL )
         {
-            data.ms = (guint16) ( number_value * 1000 );
-            number_value -= ( data.ms / 1000. );
+            NkFormatStringRegex *regex;
+            for ( regex = modifiers->replace ; regex->replacement != NULL ; ++regex )
+                _nk_format_string_compile_program(regex->replacement, references, NULL);
+            modifiers->replace_chain = _nk_format_string_regex_chain_new(self, modifiers->replace);
+            code = NK_FORMAT_STRING_OP_REPLACE;
         }
+        else if ( token->no_data )
+            code = NK_FORMAT_STRING_OP_DROP;
+        else
+            code = NK_FORMAT_STRING_OP_DATA;
 
-        if ( number_value >= 0.000001 )
+        gsize fetch, consume;
+        fetch = _nk_format_string_compile_op(program, NK_FORMAT_STRING_OP_FETCH, token);
+        _nk_format_string_program_op(program, fetch)->reference = _nk_format_string_compile_reference(references, token);
+        consume = _nk_format_string_compile_op(program, code, token);
+
+        if ( modifiers == NULL )
         {
-            data.us = (guint16) ( number_value * 1000000 );
-            number_value -= ( data.us / 1000000. );
+            _nk_format_string_program_op(program, fetch)->jump = program->len;
+            _nk_format_string_program_op(program, consume)->jump = program->len;
+            continue;
         }
 
-        if ( number_value >= 0.000000001 )
+        if ( modifiers->substitute != NULL )
         {
-            data.ns = (guint16) ( number_value * 1000000000 );
-            number_value -= ( data.ns / 1000000000. );
+            _nk_format_string_program_op(program, consume)->jump = consume + 1;
+            _nk_format_string_compile_tokens(program, references, NULL, modifiers->substitute);
         }
 
-        _nk_format_string_replace(string, prettify->duration_format, _nk_format_string_prettify_duration_callback, &data);
-    }
-    break;
-    case NK_FORMAT_STRING_PRETTIFY_JSON:
-    {
-        /* Reserve (almost all) the needed space */
-        gsize string_len = string->len;
-        gsize value_len = g_utf8_strlen(string_value, -1);
-        g_string_set_size(string, string_len + value_len);
-        g_string_truncate(string, string_len);
+        _nk_format_string_program_op(program, fetch)->jump = program->len;
+        if ( modifiers->fallback != NULL )
+            _nk_format_string_compile_tokens(program, references, NULL, modifiers->fallback);
 
-        /* Now we append characters */
-        for ( const gchar *w = string_value, *e = string_value + value_len ; w < e ; w = g_utf8_next_char(w) )
-        {
-            gunichar c = g_utf8_get_char(w);
-            switch ( c )
-            {
-            case '"':
-                g_string_append(string, "\\\"");
-            break;
-            case '\n':
-                g_string_append(string, "\\n");
-            break;
-            case '\\':
-                g_string_append(string, "\\\\");
-            break;
-            default:
-                g_string_append_unichar(string, c);
-            }
-        }
-    }
-    break;
+        if ( modifiers->substitute == NULL )
+            _nk_format_string_program_op(program, consume)->jump = program->len;
     }
 }
 
 static void
-_nk_format_string_append_data(GString *string, GVariant *data, const gchar *joiner)
+_nk_format_string_compile_program(NkFormatString *self, GArray *references, GArray *segments)
 {
-    if ( g_variant_is_of_type(data, G_VARIANT_TYPE_ARRAY) )
+    GArray *program;
+
+    program = g_array_sized_new(FALSE, FALSE, sizeof(NkFormatStringOp), self->size + 1);
+    _nk_format_string_compile_tokens(program, references, segments, self);
+    if ( segments != NULL )
     {
-        gsize length;
-        length = g_variant_n_children(data);
+        gsize end = program->len;
+        g_array_append_val(segments, end);
+    }
+    _nk_format_string_compile_op(program, NK_FORMAT_STRING_OP_END, NULL);
 
-        gsize jl = strlen(joiner);
+    self->program = _nk_format_string_alloc(self, NkFormatStringOp, program->len);
+    memcpy(self->program, program->data, program->len * sizeof(NkFormatStringOp));
+    g_array_free(program, TRUE);
+}
 
-        gsize i;
-        for ( i = 0 ; i < length ; ++i )
-        {
-            _nk_format_string_append_data(string, g_variant_get_child_value(data, i), joiner);
-            g_string_append(string, joiner);
-        }
-        g_string_truncate(string, string->len - jl);
-    }
-    else if ( g_variant_is_of_type(data, G_VARIANT_TYPE_STRING) )
-        g_string_append(string, g_variant_get_string(data, NULL));
-    else if ( g_variant_is_of_type(data, G_VARIANT_TYPE_BOOLEAN) )
-        g_string_append(string, g_variant_get_boolean(data) ? "true" : "false");
+/*
+ * The top-level format string also records where each of its
+ * top-level tokens starts in the program, as the segments used
+ * for incremental rendering (the last entry is the end).
+ */
+static void
+_nk_format_string_compile(NkFormatString *self)
+{
+    GArray *references, *segments;
+
+    references = g_array_new(FALSE, FALSE, sizeof(NkFormatStringReference));
+    segments = g_array_new(FALSE, FALSE, sizeof(gsize));
+    _nk_format_string_compile_program(self, references, segments);
+
+    self->references_size = references->len;
+    self->references = _nk_format_string_alloc(self, NkFormatStringReference, references->len);
+    memcpy(self->references, references->data, references->len * sizeof(NkFormatStringReference));
+    self->segments_size = segments->len - 1;
+    self->segments = _nk_format_string_alloc(self, gsize, segments->len);
+    memcpy(self->segments, segments->data, segments->len * sizeof(gsize));
+    g_array_free(references, TRUE);
+    g_array_free(segments, TRUE);
+}
 
-#define _nk_format_string_check_type_with_format(l, U, GFormat) \
-    else if ( g_variant_is_of_type(data, G_VARIANT_TYPE_##U) ) \
-            g_string_append_printf(string, "%" GFormat, g_variant_get_##l(data))
-#define _nk_format_string_check_type(l, U) _nk_format_string_check_type_with_format(l, U, G_G##U##_FORMAT)
+#undef _nk_format_string_program_op
 
-    _nk_format_string_check_type(int16, INT16);
-    _nk_format_string_check_type(int32, INT32);
-    _nk_format_string_check_type(int64, INT64);
-    _nk_format_string_check_type_with_format(byte, BYTE, "hhu");
-    _nk_format_string_check_type(uint16, UINT16);
-    _nk_format_string_check_type(uint32, UINT32);
-    _nk_format_string_check_type(uint64, UINT64);
-    _nk_format_string_check_type_with_format(double, DOUBLE, "lf");
+/**
+ * nk_format_string_parse:
+ * @string: (transfer full): a format string
+ * @identifier: the reference identifier character (e.g. '$')
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parses @string
+ *
+ * Returns: (transfer full): an #NkFormatString, %NULL on error
+ */
+NK_EXPORT NkFormatString *
+nk_format_string_parse(gchar *string, gunichar identifier, GError **error)
+{
+    NkFormatString *self;
 
-#undef _nk_format_string_check_type
-#undef _nk_format_string_check_type_with_format
+    self = _nk_format_string_parse(NULL, TRUE, string, identifier, error);
+    if ( self != NULL )
+        _nk_format_string_compile(self);
 
-    else
-        g_variant_print_string(data, string, FALSE);
+    return self;
 }
 
-static void
-_nk_format_string_replace(GString *string, const NkFormatString *self, NkFormatStringReplaceReferenceCallback callback, gpointer user_data)
+/**
+ * nk_format_string_parse_const:
+ * @string: (array length=length): a format string
+ * @length: the length of @string, or -1 if it is nul-terminated
+ * @identifier: the reference identifier character (e.g. '$')
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parses @string as nk_format_string_parse(), without modifying it.
+ *
+ * Literal parts are not copied: @string must outlive the #NkFormatString.
+ * This allows parsing from a read-only mapped file.
+ *
+ * Returns: (transfer full): an #NkFormatString, %NULL on error
+ */
+NK_EXPORT NkFormatString *
+nk_format_string_parse_const(const gchar *string, gssize length, gunichar identifier, GError **error)
 {
-    gsize i;
-    for ( i = 0 ; i < self->size ; ++i )
-    {
-        if ( self->tokens[i].string != NULL )
-        {
-            g_string_append(string, self->tokens[i].string);
-            continue;
-        }
+    g_return_val_if_fail(string != NULL, NULL);
+    g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
-        GVariant *data;
-        const gchar *joiner = ", ";
-        data = callback(self->tokens[i].name, self->tokens[i].value, user_data);
-        data = _nk_format_string_search_data(data, self->tokens[i].key, self->tokens[i].index, &joiner);
-        if ( _nk_format_string_check_data(data, &self->tokens[i]) )
-        {
-            if ( self->tokens[i].substitute != NULL)
-                _nk_format_string_replace(string, self->tokens[i].substitute, callback, user_data);
-            else if ( self->tokens[i].range.length > 0 )
-                _nk_format_string_append_range(string, data, &self->tokens[i].range);
-            else if ( self->tokens[i].switch_.true_ != NULL )
-                _nk_format_string_append_switch(string, data, &self->tokens[i].switch_);
-            else if ( self->tokens[i].prettify.type != NK_FORMAT_STRING_PRETTIFY_NONE )
-                _nk_format_string_append_prettify(string, data, &self->tokens[i].prettify);
-            else if ( self->tokens[i].replace != NULL )
-            {
-                NkFormatStringRegex *regex;
-                GString *tmp;
-                gchar *from;
-                gchar *to = NULL;
-
-                tmp = g_string_new("");
-                _nk_format_string_append_data(tmp, data, joiner);
-                from = g_string_free(tmp, FALSE);
-                for ( regex = self->tokens[i].replace ; regex->regex != NULL ; ++regex )
-                {
-                    gchar *replacement;
-                    replacement = nk_format_string_replace(regex->replacement, callback, user_data);
-                    to = g_regex_replace(regex->regex, from, -1, 0, replacement, 0, NULL);
-                    g_free(replacement);
-                    g_free(from);
-                    if ( to == NULL )
-                        break;
-                    from = to;
-                }
-                if ( to != NULL )
-                    g_string_append(string, to);
-                g_free(to);
-            }
-            else if ( ! self->tokens[i].no_data )
-                _nk_format_string_append_data(string, data, joiner);
-            g_variant_unref(data);
-        }
-        else if ( self->tokens[i].fallback != NULL )
-            _nk_format_string_replace(string, self->tokens[i].fallback, callback, user_data);
-    }
+    NkFormatString *self;
+
+    if ( length < 0 )
+        length = strlen(string);
+
+    self = _nk_format_string_parse_const(string, length, identifier, error);
+    if ( self != NULL )
+        _nk_format_string_compile(self);
+
+    return self;
 }
 
 /**
- * NkFormatStringReplaceReferenceCallback:
- * @name: the reference name
- * @value: the reference value (for enum-based #NkFormatString only)
- * @user_data: user_data passed to nk_format_string_replace()
- *
- * Retrieve the data referenced in the format string.
+ * nk_format_string_parse_enum:
+ * @string: (transfer full): a format string
+ * @identifier: the reference identifier character (e.g. '$')
+ * @tokens: (array length=size): a list of tokens
+ * @size: the size of @tokens
+ * @used_tokens: (out) (nullable): return location for the used tokens mask
+ * @error: return location for a #GError, or %NULL
  *
- * The function should return a #GVariant containing the data referenced by name or value.
+ * Parses @string as nk_format_string_parse().
  *
- * If the return value is a floating reference (see g_variant_ref_sink()),
- * the #NkFormatString takes ownership of it.
+ * Once parsed, each reference is checked against @tokens
  *
- * Returns: (nullable): a #GVariant containing the referenced data, may be %NULL if no data
- */
-/**
- * nk_format_string_replace:
- * @format_string: an #NkFormatString
- * @callback: an #NkFormatStringReplaceReferenceCallback used to retrieve replacement data
- * @user_data: user_data for @callback
+ * If @used_tokens is non-%NULL, @size must be inferior or equal to 64.
  *
- * Replaces all references in @format_string by data retrieved by @callback.
+ * If the function returns an #NkFormatString, @used_tokens is filled with a bitfield
+ * corresponding to all used tokens. Each bit set to 1 at position `x` (`1 << x`)
+ * means the token `x` was used.
  *
- * See #NkFormatStringReplaceReferenceCallback.
+ * If the function returns %NULL, @used_tokens is left untouched.
  *
- * Returns: the result string
+ * Returns: (transfer full): an #NkFormatString, %NULL on error
  */
-NK_EXPORT gchar *
-nk_format_string_replace(const NkFormatString *self, NkFormatStringReplaceReferenceCallback callback, gpointer user_data)
+NK_EXPORT NkFormatString *
+nk_format_string_parse_enum(gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *ret_used_tokens, GError **error)
 {
-    g_return_val_if_fail(self != NULL, NULL);
-    g_return_val_if_fail(callback != NULL, NULL);
-
-    GString *string;
-    string = g_string_sized_new(self->length);
+    g_return_val_if_fail(ret_used_tokens == NULL || size <= 64, NULL);
 
-    _nk_format_string_replace(string, self, callback, user_data);
+    guint64 used_tokens = 0;
+    NkFormatString *self;
+    self = _nk_format_string_parse_enum(NULL, TRUE, string, identifier, tokens, size, ( ret_used_tokens != NULL ) ? &used_tokens : NULL, error);
+    if ( self == NULL )
+        return NULL;
+    if ( ret_used_tokens != NULL )
+        *ret_used_tokens = used_tokens;
+    return self;
+}
 
-    return g_string_free(string, FALSE);
+/**
+ * nk_format_string_ref:
+ * @format_string: an #NkFormatString
+ *
+ * Increments the reference counter of @format_string.
+ * This is atomic, so @format_string may be shared between threads.
+ *
+ * Returns: (transfer full): the #NkFormatString
+ */
+NK_EXPORT NkFormatString *
+nk_format_string_ref(NkFormatString *self)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_atomic_int_inc(&self->ref_count);
+    return self;
+}
+
+static void _nk_format_string_replace_cache_free(NkFormatStringReplaceCache *cache);
+static void _nk_format_string_time_cache_free(NkFormatStringTimeCache *cache);
+static void
+_nk_format_string_free(NkFormatString *self)
+{
+    if ( self->owned )
+        g_free(self->string);
+
+    /* Everything else is in the arena */
+    gsize i;
+    for ( i = 0 ; i < self->size ; ++i )
+    {
+        NkFormatStringTokenModifiers *modifiers = self->tokens[i].modifiers;
+        if ( modifiers == NULL )
+            continue;
+
+        if ( modifiers->substitute != NULL)
+            _nk_format_string_free(modifiers->substitute);
+        if ( modifiers->time_cache != NULL )
+            _nk_format_string_time_cache_free(modifiers->time_cache);
+        if ( modifiers->prettify.duration_format != NULL )
+            nk_format_string_unref(modifiers->prettify.duration_format);
+        if ( modifiers->replace != NULL )
+        {
+            NkFormatStringRegex *regex;
+            for ( regex = modifiers->replace ; regex->replacement != NULL ; ++regex )
+            {
+                if ( regex->regex != NULL )
+                    g_regex_unref(regex->regex);
+                _nk_format_string_free(regex->replacement);
+            }
+        }
+        if ( modifiers->replace_cache != NULL )
+            _nk_format_string_replace_cache_free(modifiers->replace_cache);
+        if ( modifiers->fallback != NULL )
+            _nk_format_string_free(modifiers->fallback);
+    }
+
+    if ( self->blob != NULL )
+        g_variant_unref(self->blob);
+    if ( self->profile != NULL )
+        _nk_format_string_profile_free(self->profile);
+
+    if ( self->root == self )
+    {
+        /* self lives in its own arena */
+        NkFormatStringArena arena = self->arena;
+        _nk_format_string_arena_release(&arena);
+    }
+}
+
+/**
+ * nk_format_string_unref:
+ * @format_string: an #NkFormatString
+ *
+ * Decrements the reference counter of @format_string.
+ * If it reaches 0, free @format_string.
+ */
+NK_EXPORT void
+nk_format_string_unref(NkFormatString *self)
+{
+    g_return_if_fail(self != NULL);
+    if ( ! g_atomic_int_dec_and_test(&self->ref_count) )
+        return;
+
+    _nk_format_string_free(self);
+}
+
+#define NK_FORMAT_STRING_CACHE_DEFAULT_SIZE 64
+
+typedef struct {
+    gchar *string;
+    gunichar identifier;
+    const gchar * const *tokens;
+    guint64 size;
+} NkFormatStringCacheKey;
+
+typedef struct {
+    NkFormatStringCacheKey key;
+    GList link;
+    NkFormatString *format_string;
+    guint64 used_tokens;
+} NkFormatStringCacheEntry;
+
+static struct {
+    GHashTable *entries;
+    GQueue lru;
+    gsize max_size;
+    guint64 hits;
+    guint64 misses;
+} _nk_format_string_cache = {
+    .max_size = NK_FORMAT_STRING_CACHE_DEFAULT_SIZE,
+};
+G_LOCK_DEFINE_STATIC(_nk_format_string_cache);
+
+static guint
+_nk_format_string_cache_key_hash(gconstpointer key_)
+{
+    const NkFormatStringCacheKey *key = key_;
+    return g_str_hash(key->string) ^ key->identifier ^ g_direct_hash(key->tokens);
+}
+
+static gboolean
+_nk_format_string_cache_key_equal(gconstpointer a_, gconstpointer b_)
+{
+    const NkFormatStringCacheKey *a = a_, *b = b_;
+    return ( a->identifier == b->identifier ) && ( a->tokens == b->tokens ) && ( a->size == b->size ) && ( strcmp(a->string, b->string) == 0 );
+}
+
+static void
+_nk_format_string_cache_entry_free(gpointer data)
+{
+    NkFormatStringCacheEntry *entry = data;
+
+    nk_format_string_unref(entry->format_string);
+    g_free(entry->key.string);
+
+    g_free(entry);
+}
+
+/* Called with the lock held */
+static void
+_nk_format_string_cache_trim(gsize max_size)
+{
+    while ( _nk_format_string_cache.lru.length > max_size )
+    {
+        GList *link = g_queue_pop_tail_link(&_nk_format_string_cache.lru);
+        NkFormatStringCacheEntry *entry = link->data;
+        g_hash_table_remove(_nk_format_string_cache.entries, &entry->key);
+    }
+}
+
+static NkFormatString *
+_nk_format_string_parse_shared(const gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *used_tokens, GError **error)
+{
+    NkFormatStringCacheKey key = {
+        .string = (gchar *) string,
+        .identifier = identifier,
+        .tokens = tokens,
+        .size = size,
+    };
+    NkFormatStringCacheEntry *entry;
+    NkFormatString *self;
+    guint64 used_tokens_ = 0;
+
+    G_LOCK(_nk_format_string_cache);
+    if ( _nk_format_string_cache.entries == NULL )
+    {
+        _nk_format_string_cache.entries = g_hash_table_new_full(_nk_format_string_cache_key_hash, _nk_format_string_cache_key_equal, NULL, _nk_format_string_cache_entry_free);
+        g_queue_init(&_nk_format_string_cache.lru);
+    }
+
+    entry = g_hash_table_lookup(_nk_format_string_cache.entries, &key);
+    if ( entry != NULL )
+    {
+        ++_nk_format_string_cache.hits;
+        g_queue_unlink(&_nk_format_string_cache.lru, &entry->link);
+        g_queue_push_head_link(&_nk_format_string_cache.lru, &entry->link);
+        self = nk_format_string_ref(entry->format_string);
+        used_tokens_ = entry->used_tokens;
+        G_UNLOCK(_nk_format_string_cache);
+
+        if ( used_tokens != NULL )
+            *used_tokens = used_tokens_;
+        return self;
+    }
+    ++_nk_format_string_cache.misses;
+    G_UNLOCK(_nk_format_string_cache);
+
+    if ( tokens != NULL )
+        self = nk_format_string_parse_enum(g_strdup(string), identifier, tokens, size, &used_tokens_, error);
+    else
+        self = nk_format_string_parse(g_strdup(string), identifier, error);
+    if ( self == NULL )
+        return NULL;
+    if ( used_tokens != NULL )
+        *used_tokens = used_tokens_;
+
+    G_LOCK(_nk_format_string_cache);
+    if ( ( _nk_format_string_cache.max_size > 0 ) && ( ! g_hash_table_contains(_nk_format_string_cache.entries, &key) ) )
+    {
+        entry = g_new0(NkFormatStringCacheEntry, 1);
+        entry->key = key;
+        entry->key.string = g_strdup(string);
+        entry->link.data = entry;
+        entry->format_string = nk_format_string_ref(self);
+        entry->used_tokens = used_tokens_;
+
+        g_hash_table_insert(_nk_format_string_cache.entries, &entry->key, entry);
+        g_queue_push_head_link(&_nk_format_string_cache.lru, &entry->link);
+        _nk_format_string_cache_trim(_nk_format_string_cache.max_size);
+    }
+    G_UNLOCK(_nk_format_string_cache);
+
+    return self;
+}
+
+/**
+ * nk_format_string_parse_shared:
+ * @string: a format string
+ * @identifier: the reference identifier character (e.g. '$')
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parses @string as nk_format_string_parse(), going through a process-wide
+ * cache: parsing the same string again returns the same #NkFormatString.
+ *
+ * The cache keeps the most recently used format strings,
+ * see nk_format_string_cache_set_size().
+ *
+ * Returns: (transfer full): an #NkFormatString, %NULL on error
+ */
+NK_EXPORT NkFormatString *
+nk_format_string_parse_shared(const gchar *string, gunichar identifier, GError **error)
+{
+    g_return_val_if_fail(string != NULL, NULL);
+    g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+    return _nk_format_string_parse_shared(string, identifier, NULL, 0, NULL, error);
+}
+
+/**
+ * nk_format_string_parse_enum_shared:
+ * @string: a format string
+ * @identifier: the reference identifier character (e.g. '$')
+ * @tokens: (array length=size): a list of tokens
+ * @size: the size of @tokens
+ * @used_tokens: (out) (nullable): return location for the used tokens mask
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parses @string as nk_format_string_parse_enum(), going through the same
+ * cache as nk_format_string_parse_shared().
+ * @tokens is part of the cache key by address, so it should be a static table.
+ *
+ * Returns: (transfer full): an #NkFormatString, %NULL on error
+ */
+NK_EXPORT NkFormatString *
+nk_format_string_parse_enum_shared(const gchar *string, gunichar identifier, const gchar * const *tokens, guint64 size, guint64 *used_tokens, GError **error)
+{
+    g_return_val_if_fail(string != NULL, NULL);
+    g_return_val_if_fail(tokens != NULL, NULL);
+    g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+    return _nk_format_string_parse_shared(string, identifier, tokens, size, used_tokens, error);
+}
+
+/**
+ * nk_format_string_cache_set_size:
+ * @size: the maximum number of format strings in the cache
+ *
+ * Sets the maximum size of the nk_format_string_parse_shared() cache,
+ * evicting the least recently used format strings if needed.
+ * A size of 0 disables the cache.
+ */
+NK_EXPORT void
+nk_format_string_cache_set_size(gsize size)
+{
+    G_LOCK(_nk_format_string_cache);
+    _nk_format_string_cache.max_size = size;
+    if ( _nk_format_string_cache.entries != NULL )
+        _nk_format_string_cache_trim(size);
+    G_UNLOCK(_nk_format_string_cache);
+}
+
+/**
+ * nk_format_string_cache_clear:
+ *
+ * Evicts all the format strings from the nk_format_string_parse_shared() cache.
+ * Format strings still in use are not affected.
+ */
+NK_EXPORT void
+nk_format_string_cache_clear(void)
+{
+    G_LOCK(_nk_format_string_cache);
+    if ( _nk_format_string_cache.entries != NULL )
+        _nk_format_string_cache_trim(0);
+    G_UNLOCK(_nk_format_string_cache);
+}
+
+/**
+ * nk_format_string_cache_get_stats:
+ * @hits: (out) (nullable): return location for the number of cache hits
+ * @misses: (out) (nullable): return location for the number of cache misses
+ *
+ * Retrieves the nk_format_string_parse_shared() cache counters.
+ */
+NK_EXPORT void
+nk_format_string_cache_get_stats(guint64 *hits, guint64 *misses)
+{
+    G_LOCK(_nk_format_string_cache);
+    if ( hits != NULL )
+        *hits = _nk_format_string_cache.hits;
+    if ( misses != NULL )
+        *misses = _nk_format_string_cache.misses;
+    G_UNLOCK(_nk_format_string_cache);
+}
+
+static GVariant *
+_nk_format_string_unbox_data(GVariant *data)
+{
+    while ( ( data != NULL ) && ( g_variant_classify(data) == G_VARIANT_CLASS_VARIANT ) )
+    {
+        GVariant *child = g_variant_get_variant(data);
+        g_variant_unref(data);
+        data = child;
+    }
+    return data;
+}
+
+static GVariant *
+_nk_format_string_search_data(GVariant *source, const gchar *key, gint64 index, const gchar **joiner)
+{
+    if ( source == NULL )
+        return NULL;
+
+    GVariant *data, *child = NULL;
+    data = _nk_format_string_unbox_data(g_variant_ref(source));
+
+    if ( g_variant_classify(data) != G_VARIANT_CLASS_ARRAY )
+        child = g_variant_ref(data);
+    else if ( g_variant_get_type_string(data)[1] == G_VARIANT_CLASS_DICT_ENTRY )
+    {
+        if ( ( key != NULL ) && ( g_utf8_get_char(key) != '\0' ) )
+            child = g_variant_lookup_value(data, key, NULL);
+    }
+    else
+    {
+        gsize length;
+        length = g_variant_n_children(data);
+
+        if ( length == 0 )
+            ;
+        else if ( key == NULL )
+            child = g_variant_ref(data);
+        else
+        switch ( g_utf8_get_char(key) )
+        {
+        case '\0':
+        {
+            gsize i = ABS(index);
+            if ( ( index < 0 ) && ( i <= length ) )
+                child = g_variant_get_child_value(data, length - i);
+            else if ( ( index >= 0 ) && ( i < length ) )
+                child = g_variant_get_child_value(data, i);
+        }
+        break;
+        case '@':
+        {
+            const gchar *s = g_utf8_next_char(key);
+            if ( g_utf8_get_char(s) != '\0')
+                *joiner = s;
+            child = g_variant_ref(data);
+        }
+        break;
+        default:
+        break;
+        }
+    }
+    g_variant_unref(data);
+
+    return _nk_format_string_unbox_data(child);
+}
+
+/*
+ * Data is carried around as a typed value.
+ * When coming from a #GVariant, scalars are unwrapped once
+ * and the variant is kept to own the value (e.g. a string).
+ */
+typedef struct {
+    NkFormatStringValue value;
+    GVariant *variant;
+    gboolean searched;
+    GVariant *dictionary;
+    GHashTable *index;
+} NkFormatStringData;
+
+static void
+_nk_format_string_data_set_variant(NkFormatStringData *data, GVariant *variant)
+{
+    data->variant = variant;
+
+    if ( variant == NULL )
+    {
+        data->value.type = NK_FORMAT_STRING_VALUE_TYPE_NONE;
+        return;
+    }
+
+#define _nk_format_string_data_check_type(l, U, T, m) \
+    case NK_FORMAT_STRING_VARIANT_CLASS_##U: \
+        data->value.type = NK_FORMAT_STRING_VALUE_TYPE_##T; \
+        data->value.data.m = g_variant_get_##l(variant); \
+    break
+
+    switch ( _nk_format_string_variant_classify(variant) )
+    {
+    case NK_FORMAT_STRING_VARIANT_CLASS_STRING:
+        data->value.type = NK_FORMAT_STRING_VALUE_TYPE_STRING;
+        data->value.data.string = g_variant_get_string(variant, NULL);
+    break;
+    _nk_format_string_data_check_type(boolean, BOOLEAN, BOOLEAN, boolean);
+    _nk_format_string_data_check_type(int16, INT16, INT64, int64);
+    _nk_format_string_data_check_type(int32, INT32, INT64, int64);
+    _nk_format_string_data_check_type(int64, INT64, INT64, int64);
+    _nk_format_string_data_check_type(byte, BYTE, UINT64, uint64);
+    _nk_format_string_data_check_type(uint16, UINT16, UINT64, uint64);
+    _nk_format_string_data_check_type(uint32, UINT32, UINT64, uint64);
+    _nk_format_string_data_check_type(uint64, UINT64, UINT64, uint64);
+    _nk_format_string_data_check_type(double, DOUBLE, DOUBLE, double_);
+    case NK_FORMAT_STRING_VARIANT_CLASS_OTHER:
+    case NK_FORMAT_STRING_VARIANT_CLASS_ARRAY:
+    case NK_FORMAT_STRING_VARIANT_CLASS_VARIANT:
+    case NK_FORMAT_STRING_VARIANT_CLASS_SIZE:
+        data->value.type = NK_FORMAT_STRING_VALUE_TYPE_VARIANT;
+        data->value.data.variant = variant;
+    break;
+    }
+
+#undef _nk_format_string_data_check_type
+}
+
+static void
+_nk_format_string_data_clear(NkFormatStringData *data)
+{
+    if ( data->index != NULL )
+    {
+        g_hash_table_unref(data->index);
+        g_variant_unref(data->dictionary);
+    }
+    data->index = NULL;
+    data->dictionary = NULL;
+    data->searched = FALSE;
+    if ( data->variant != NULL )
+        g_variant_unref(data->variant);
+    data->variant = NULL;
+    data->value.type = NK_FORMAT_STRING_VALUE_TYPE_NONE;
+}
+
+/*
+ * Keys point into the dictionary, which the data keeps alive.
+ * Like g_variant_lookup_value(), the first entry wins.
+ */
+static GHashTable *
+_nk_format_string_data_index(GVariant *dictionary)
+{
+    GHashTable *index;
+    gsize i, length = g_variant_n_children(dictionary);
+
+    index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_variant_unref);
+    for ( i = 0 ; i < length ; ++i )
+    {
+        const gchar *key;
+        GVariant *value;
+        g_variant_get_child(dictionary, i, "{&s@*}", &key, &value);
+        if ( g_hash_table_contains(index, key) )
+            g_variant_unref(value);
+        else
+            g_hash_table_insert(index, (gpointer) key, value);
+    }
+
+    return index;
+}
+
+/*
+ * A dictionary used by several keyed tokens (e.g. `${ref[a]} ${ref[b]}`)
+ * is indexed on the second lookup, for the lifetime of the data.
+ */
+static GVariant *
+_nk_format_string_data_search(NkFormatStringData *source, const gchar *key, gint64 index, const gchar **joiner)
+{
+    if ( ( key == NULL ) || ( *key == '\0' ) )
+        return _nk_format_string_search_data(source->variant, key, index, joiner);
+
+    if ( ( source->index == NULL ) && source->searched )
+    {
+        GVariant *data = _nk_format_string_unbox_data(g_variant_ref(source->variant));
+        if ( g_variant_is_of_type(data, G_VARIANT_TYPE("a{s*}")) )
+        {
+            source->dictionary = data;
+            source->index = _nk_format_string_data_index(data);
+        }
+        else
+            g_variant_unref(data);
+    }
+    source->searched = TRUE;
+
+    if ( source->index == NULL )
+        return _nk_format_string_search_data(source->variant, key, index, joiner);
+
+    GVariant *child = g_hash_table_lookup(source->index, key);
+    if ( child == NULL )
+        return NULL;
+    return _nk_format_string_unbox_data(g_variant_ref(child));
+}
+
+static gboolean
+_nk_format_string_double_from_value(const NkFormatStringValue *value, gdouble *ret)
+{
+    switch ( value->type )
+    {
+    case NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN:
+        *ret = value->data.boolean ? 1 : 0;
+        return TRUE;
+    case NK_FORMAT_STRING_VALUE_TYPE_INT64:
+        *ret = value->data.int64;
+        return TRUE;
+    case NK_FORMAT_STRING_VALUE_TYPE_UINT64:
+        *ret = value->data.uint64;
+        return TRUE;
+    case NK_FORMAT_STRING_VALUE_TYPE_DOUBLE:
+        *ret = value->data.double_;
+        return TRUE;
+    case NK_FORMAT_STRING_VALUE_TYPE_NONE:
+    case NK_FORMAT_STRING_VALUE_TYPE_STRING:
+    case NK_FORMAT_STRING_VALUE_TYPE_VARIANT:
+    break;
+    }
+    return FALSE;
+}
+
+static gboolean
+_nk_format_string_check_data(const NkFormatStringValue *value, const NkFormatStringToken *part)
+{
+    switch ( value->type )
+    {
+    case NK_FORMAT_STRING_VALUE_TYPE_NONE:
+        return FALSE;
+    case NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN:
+        /* We want a boolean data to still be replaced if it’s not checked against */
+        if ( ! value->data.boolean )
+            return ( ( part->modifiers == NULL ) || ( ( part->modifiers->fallback == NULL ) && ( part->modifiers->substitute == NULL ) ) );
+    break;
+    default:
+    break;
+    }
+
+    return TRUE;
+}
+
+typedef struct {
+    guint64 calls;
+    guint64 callback_time;
+    guint64 format_time;
+    guint64 bytes;
+} NkFormatStringProfileCounters;
+
+typedef struct {
+    NkFormatStringReplaceReferenceCallback callback;
+    NkFormatStringReplaceValueCallback value_callback;
+    NkFormatStringReplaceReferencesCallback references_callback;
+    gpointer user_data;
+    NkFormatStringData *data;
+    gboolean *resolved;
+    GString *sink;
+    GArray *vectors;
+    gsize flushed;
+    gsize written; /* Literals written straight from the format string */
+    NkFormatStringProfile *profile;
+    NkFormatStringProfileCounters *counters;
+    const NkFormatStringOp *profiled;
+    guint64 callback_time; /* Of all profiled tokens so far */
+} NkFormatStringRenderContext;
+
+static void _nk_format_string_run(GString *string, const NkFormatStringOp *program, const NkFormatStringOp *op, const NkFormatStringOp *end, NkFormatStringRenderContext *context);
+static void _nk_format_string_replace(GString *string, const NkFormatString *self, NkFormatStringRenderContext *context);
+
+/*
+ * Profiling counts each top-level program token (i.e. each FETCH op,
+ * fallback and substitute ones included) in a per-render array indexed
+ * by op, merged once at the end of the rendering.
+ * When disabled, it only costs a pointer check per FETCH op.
+ */
+struct _NkFormatStringProfile {
+    gint enabled;
+    GMutex lock;
+    const NkFormatStringOp *program;
+    gsize size;
+    guint64 renders;
+    NkFormatStringProfileCounters counters[];
+};
+
+static gint64
+_nk_format_string_profile_now(void)
+{
+#ifdef G_OS_UNIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+#else /* ! G_OS_UNIX */
+    return g_get_monotonic_time() * 1000;
+#endif /* ! G_OS_UNIX */
+}
+
+static void
+_nk_format_string_profile_free(NkFormatStringProfile *profile)
+{
+    g_mutex_clear(&profile->lock);
+    g_free(profile);
+}
+
+static NkFormatStringProfile *
+_nk_format_string_profile_get(NkFormatString *self)
+{
+    NkFormatStringProfile *profile = g_atomic_pointer_get(&self->profile);
+    if ( profile != NULL )
+        return profile;
+
+    /* The END op is the last one */
+    gsize size = self->segments[self->segments_size] + 1;
+    profile = g_malloc0(sizeof(NkFormatStringProfile) + size * sizeof(NkFormatStringProfileCounters));
+    g_mutex_init(&profile->lock);
+    profile->program = self->program;
+    profile->size = size;
+    if ( ! g_atomic_pointer_compare_and_exchange(&self->profile, NULL, profile) )
+    {
+        /* Another thread was faster */
+        _nk_format_string_profile_free(profile);
+        profile = g_atomic_pointer_get(&self->profile);
+    }
+    return profile;
+}
+
+static void
+_nk_format_string_profile_start(const NkFormatString *self, NkFormatStringRenderContext *context)
+{
+    NkFormatStringProfile *profile = g_atomic_pointer_get(&self->profile);
+    if ( G_LIKELY(( profile == NULL ) || ( ! g_atomic_int_get(&profile->enabled) )) )
+        return;
+
+    context->profile = profile;
+    context->counters = g_new0(NkFormatStringProfileCounters, profile->size);
+}
+
+static void
+_nk_format_string_profile_stop(NkFormatStringRenderContext *context)
+{
+    NkFormatStringProfile *profile = context->profile;
+    gsize i;
+
+    g_mutex_lock(&profile->lock);
+    ++profile->renders;
+    for ( i = 0 ; i < profile->size ; ++i )
+    {
+        profile->counters[i].calls += context->counters[i].calls;
+        profile->counters[i].callback_time += context->counters[i].callback_time;
+        profile->counters[i].format_time += context->counters[i].format_time;
+        profile->counters[i].bytes += context->counters[i].bytes;
+    }
+    g_mutex_unlock(&profile->lock);
+
+    g_free(context->counters);
+    context->counters = NULL;
+    context->profile = NULL;
+}
+
+static void
+_nk_format_string_append_range(GString *string, const NkFormatStringValue *data, const NkFormatStringRange *range)
+{
+    gdouble value;
+    if ( ! _nk_format_string_double_from_value(data, &value) )
+        return;
+
+    gdouble v, r;
+    gsize i;
+
+    if ( value >= range->max )
+        i = range->length - 1;
+    else if ( value < range->min )
+        i = 0;
+    else
+    {
+        v = value - range->min;
+        r = range->max - range->min;
+        i = (gsize) ( (gdouble) ( range->length ) * ( v / r ) );
+    }
+    g_string_append(string, range->values[i]);
+}
+
+static void
+_nk_format_string_append_switch(GString *string, const NkFormatStringValue *data, const NkFormatStringSwitch *switch_)
+{
+    if ( data->type != NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN )
+        return;
+
+    g_string_append(string, data->data.boolean ? switch_->true_ : switch_->false_);
+}
+
+/* Units are given as typed values, no #GVariant involved */
+static void
+_nk_format_string_prettify_duration_callback(G_GNUC_UNUSED const gchar *name, guint64 value, NkFormatStringValue *ret, gpointer user_data)
+{
+    NkFormatStringPrettifyDurationData *data = user_data;
+    guint64 v = 0;
+    switch ( (NkFormatStringPrettifyDurationToken) value )
+    {
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_WEEKS:
+        v = data->w;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_DAYS:
+        v = data->d;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_HOURS:
+        v = data->h;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_MINUTES:
+        v = data->m;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_SECONDS:
+        v = data->s;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_MILLISECONDS:
+        v = data->ms;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_MICROSECONDS:
+        v = data->us;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION_TOKEN_NANOSECONDS:
+        v = data->ns;
+    break;
+    }
+    if ( v == 0 )
+        return;
+
+    ret->type = NK_FORMAT_STRING_VALUE_TYPE_UINT64;
+    ret->data.uint64 = v;
+}
+
+static const gchar *_nk_format_string_prefixes_si_big[] = {
+    "", "k", "M", "G", "T", "P", "E"
+};
+static const gchar *_nk_format_string_prefixes_si_small[] = {
+    "", "m", "µ", "n", "p", "f", "a"
+};
+static const gchar *_nk_format_string_prefixes_binary[] = {
+    "", "Ki", "Mi", "Gi", "Ti"
+};
+
+static const gchar _nk_format_string_json_escapes[0x20] = {
+    ['\b'] = 'b',
+    ['\f'] = 'f',
+    ['\n'] = 'n',
+    ['\r'] = 'r',
+    ['\t'] = 't',
+};
+
+static const gchar _nk_format_string_json_hex[] = "0123456789abcdef";
+
+#define _nk_format_string_json_needs_escape(c) ( ( (guchar) (c) < 0x20 ) || ( (c) == '"' ) || ( (c) == '\\' ) )
+
+/*
+ * Returns the length of the start of s which needs no escaping,
+ * checking a whole block of bytes at a time
+ */
+static gsize
+_nk_format_string_json_clean_length(const gchar *s, gsize length)
+{
+    gsize i = 0;
+
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for ( ; ( i + 16 ) <= length ; i += 16 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) ( s + i ));
+        __m128i m;
+        /* Unsigned v <= 0x1f */
+        m = _mm_cmpeq_epi8(_mm_max_epu8(v, control), control);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+        gint mask = _mm_movemask_epi8(m);
+        if ( mask != 0 )
+            return i + g_bit_nth_lsf(mask, -1);
+    }
+#else /* ! __SSE2__ */
+    for ( ; ( i + sizeof(guint64) ) <= length ; i += sizeof(guint64) )
+    {
+        guint64 v;
+        memcpy(&v, s + i, sizeof(guint64));
+        /* Any byte < 0x20, '"' or '\\' in the word, found byte by byte below */
+        if ( ( ( v - _nk_format_string_swar_ones * 0x20 ) & ~v & _nk_format_string_swar_highs )
+            || _nk_format_string_swar_has_byte(v, '"')
+            || _nk_format_string_swar_has_byte(v, '\\') )
+            break;
+    }
+#endif /* ! __SSE2__ */
+
+    for ( ; i < length ; ++i )
+    {
+        if ( _nk_format_string_json_needs_escape(s[i]) )
+            return i;
+    }
+    return length;
+}
+
+/* Makes sure length more bytes can be appended without reallocating */
+static void
+_nk_format_string_reserve(GString *string, gsize length)
+{
+    gsize string_len = string->len;
+    g_string_set_size(string, string_len + length);
+    g_string_truncate(string, string_len);
+}
+
+static void
+_nk_format_string_append_json(GString *string, const gchar *s)
+{
+    gsize length = strlen(s);
+    const gchar *e = s + length;
+
+    /* Reserve (almost all) the needed space */
+    _nk_format_string_reserve(string, length);
+
+    /* Clean runs are copied as a whole */
+    while ( s < e )
+    {
+        gsize clean = _nk_format_string_json_clean_length(s, e - s);
+        g_string_append_len(string, s, clean);
+        s += clean;
+        if ( s == e )
+            break;
+
+        guchar c = *s++;
+        g_string_append_c(string, '\\');
+        if ( ( c == '"' ) || ( c == '\\' ) )
+            g_string_append_c(string, c);
+        else if ( _nk_format_string_json_escapes[c] != '\0' )
+            g_string_append_c(string, _nk_format_string_json_escapes[c]);
+        else
+        {
+            g_string_append(string, "u00");
+            g_string_append_c(string, _nk_format_string_json_hex[c >> 4]);
+            g_string_append_c(string, _nk_format_string_json_hex[c & 0xf]);
+        }
+    }
+}
+
+#undef _nk_format_string_json_needs_escape
+
+static const gchar _nk_format_string_digits_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Writes the digits backward, ending at e, returns the first one */
+static gchar *
+_nk_format_string_uint64_digits(gchar *e, guint64 value)
+{
+    while ( value >= 100 )
+    {
+        guint i = ( value % 100 ) * 2;
+        value /= 100;
+        *--e = _nk_format_string_digits_pairs[i + 1];
+        *--e = _nk_format_string_digits_pairs[i];
+    }
+    if ( value >= 10 )
+    {
+        guint i = value * 2;
+        *--e = _nk_format_string_digits_pairs[i + 1];
+        *--e = _nk_format_string_digits_pairs[i];
+    }
+    else
+        *--e = '0' + value;
+    return e;
+}
+
+static void
+_nk_format_string_append_uint64(GString *string, guint64 value)
+{
+    gchar buffer[20];
+    gchar *e = buffer + sizeof(buffer);
+    gchar *s = _nk_format_string_uint64_digits(e, value);
+    g_string_append_len(string, s, e - s);
+}
+
+static void
+_nk_format_string_append_int64(GString *string, gint64 value)
+{
+    gchar buffer[21];
+    gchar *e = buffer + sizeof(buffer);
+    gchar *s;
+    if ( value < 0 )
+    {
+        s = _nk_format_string_uint64_digits(e, - (guint64) value);
+        *--s = '-';
+    }
+    else
+        s = _nk_format_string_uint64_digits(e, value);
+    g_string_append_len(string, s, e - s);
+}
+
+static void
+_nk_format_string_append_padding(GString *string, gchar c, gsize count)
+{
+    gsize len = string->len;
+    g_string_set_size(string, len + count);
+    memset(string->str + len, c, count);
+}
+
+static const gdouble _nk_format_string_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+};
+
+/*
+ * Appends value as printf("%*.*lf") would.
+ * We scale the value to an integer and only keep it when the rounding
+ * cannot go the other way than on the exact binary value,
+ * leaving huge, non-finite or near-tie values to printf.
+ */
+static void
+_nk_format_string_append_double(GString *string, gdouble value, gint width, gint precision, gboolean zero)
+{
+    if ( precision < 0 )
+        precision = 6;
+
+    gboolean negative = signbit(value);
+    gdouble v = negative ? -value : value;
+    gdouble scaled = 0;
+    guint64 n = 0;
+
+    if ( ( precision >= (gint) G_N_ELEMENTS(_nk_format_string_powers_of_ten) ) || ( ! isfinite(v) ) )
+        goto fallback;
+    scaled = v * _nk_format_string_powers_of_ten[precision];
+    if ( scaled >= 9007199254740992. ) /* 2^53 */
+        goto fallback;
+
+    n = (guint64) scaled;
+    gdouble half = scaled - (gdouble) n - 0.5;
+    /* The product is off by half an ulp at most */
+    gdouble error = scaled * ( 1. / 4503599627370496. ); /* 2^-52 */
+    if ( ( half <= error ) && ( -half <= error ) )
+        goto fallback;
+    if ( half > 0 )
+        ++n;
+
+    const gchar *point = localeconv()->decimal_point;
+    gsize point_length = strlen(point);
+    if ( point_length > 8 )
+        goto fallback;
+
+    gchar buffer[20 + 8 + 15];
+    gchar *e = buffer + sizeof(buffer);
+    gchar *s = e;
+
+    if ( precision > 0 )
+    {
+        guint64 p = (guint64) _nk_format_string_powers_of_ten[precision];
+        gchar *f = e - precision;
+        s = _nk_format_string_uint64_digits(e, n % p);
+        while ( s > f )
+            *--s = '0';
+        s -= point_length;
+        memcpy(s, point, point_length);
+        n /= p;
+    }
+    s = _nk_format_string_uint64_digits(s, n);
+
+    gint pad = width - ( e - s ) - ( negative ? 1 : 0 );
+    if ( ( pad > 0 ) && ( ! zero ) )
+        _nk_format_string_append_padding(string, ' ', pad);
+    if ( negative )
+        g_string_append_c(string, '-');
+    if ( ( pad > 0 ) && zero )
+        _nk_format_string_append_padding(string, '0', pad);
+    g_string_append_len(string, s, e - s);
+    return;
+
+fallback:
+    g_string_append_printf(string, zero ? "%0*.*lf" : "%*.*lf", width, precision, value);
+}
+
+/* Internal, see format-string-internal.h, for the benchmark to compare them with printf */
+void
+nk_format_string_append_int64(GString *string, gint64 value)
+{
+    _nk_format_string_append_int64(string, value);
+}
+
+void
+nk_format_string_append_uint64(GString *string, guint64 value)
+{
+    _nk_format_string_append_uint64(string, value);
+}
+
+void
+nk_format_string_append_double(GString *string, gdouble value, gint width, gint precision, gboolean zero)
+{
+    _nk_format_string_append_double(string, value, width, precision, zero);
+}
+
+/*
+ * Each time token keeps its last result along with the time span
+ * it is valid for, from the granularity of its format
+ * (e.g. a minute for "%H:%M"), and the local timezone it used.
+ */
+struct _NkFormatStringTimeCache {
+    GMutex lock;
+    GTimeZone *tz;
+    gint64 start;
+    gint64 end;
+    GString *result;
+};
+
+static void
+_nk_format_string_time_cache_free(NkFormatStringTimeCache *cache)
+{
+    g_string_free(cache->result, TRUE);
+    if ( cache->tz != NULL )
+        g_time_zone_unref(cache->tz);
+    g_mutex_clear(&cache->lock);
+
+    g_free(cache);
+}
+
+/* The cache is created on first use, as regexes may be */
+static NkFormatStringTimeCache *
+_nk_format_string_time_cache_get(NkFormatStringTimeCache **cache_)
+{
+    NkFormatStringTimeCache *cache = g_atomic_pointer_get(cache_);
+    if ( G_LIKELY(cache != NULL) )
+        return cache;
+
+    cache = g_new0(NkFormatStringTimeCache, 1);
+    g_mutex_init(&cache->lock);
+    cache->result = g_string_new("");
+    if ( ! g_atomic_pointer_compare_and_exchange(cache_, NULL, cache) )
+    {
+        /* Another thread was faster */
+        _nk_format_string_time_cache_free(cache);
+        cache = g_atomic_pointer_get(cache_);
+    }
+    return cache;
+}
+
+static void
+_nk_format_string_time_cache_update(NkFormatStringTimeCache *cache, gint64 value, GDateTime *time, gint granularity)
+{
+    /* An empty span, never used */
+    cache->start = cache->end = 0;
+
+    if ( granularity == 0 )
+        return;
+    if ( granularity == 1 )
+    {
+        cache->start = value;
+        cache->end = value + 1;
+        return;
+    }
+
+    gint year, month, day, hour = 0, minute = 0, second = 0;
+    g_date_time_get_ymd(time, &year, &month, &day);
+    if ( granularity < 86400 )
+        hour = g_date_time_get_hour(time);
+    if ( granularity < 3600 )
+        minute = g_date_time_get_minute(time);
+    if ( granularity < 60 )
+        second = g_date_time_get_second(time);
+
+    GDateTime *start, *end;
+    start = g_date_time_new(cache->tz, year, month, day, hour, minute, second);
+    if ( start == NULL )
+        return;
+    /* Days may not be 24 hours long */
+    if ( granularity == 86400 )
+        end = g_date_time_add_days(start, 1);
+    else
+        end = g_date_time_add_seconds(start, granularity);
+
+    if ( end != NULL )
+    {
+        gint64 s = g_date_time_to_unix(start), e = g_date_time_to_unix(end);
+        /* Ambiguous local times may have given another span */
+        if ( ( s <= value ) && ( value < e ) )
+        {
+            cache->start = s;
+            cache->end = e;
+        }
+        g_date_time_unref(end);
+    }
+    g_date_time_unref(start);
+}
+
+static void
+_nk_format_string_append_time(GString *string, gint64 value, const NkFormatStringPrettify *prettify, NkFormatStringTimeCache **cache_)
+{
+    NkFormatStringTimeCache *cache = _nk_format_string_time_cache_get(cache_);
+
+    g_mutex_lock(&cache->lock);
+    if ( ( cache->start <= value ) && ( value < cache->end ) )
+    {
+        g_string_append_len(string, cache->result->str, cache->result->len);
+        g_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    GDateTime *utc, *time = NULL;
+    gchar *result = NULL;
+
+    /* The local timezone may have changed (TZ, /etc/localtime, rules update) */
+    if ( cache->tz != NULL )
+        g_time_zone_unref(cache->tz);
+    cache->tz = g_time_zone_new_local();
+
+    cache->start = cache->end = 0;
+    utc = g_date_time_new_from_unix_utc(value);
+    if ( utc != NULL )
+    {
+        time = g_date_time_to_timezone(utc, cache->tz);
+        g_date_time_unref(utc);
+    }
+    if ( time != NULL )
+    {
+        result = g_date_time_format(time, prettify->time_format);
+        if ( result != NULL )
+            _nk_format_string_time_cache_update(cache, value, time, prettify->time_granularity);
+        g_date_time_unref(time);
+    }
+    if ( result != NULL )
+    {
+        g_string_assign(cache->result, result);
+        g_string_append(string, result);
+        g_free(result);
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+static void
+_nk_format_string_append_prettify(GString *string, const NkFormatStringValue *data, const NkFormatStringPrettify *prettify, NkFormatStringTimeCache **time_cache)
+{
+    gdouble number_value = 0;
+    const gchar *string_value = NULL;
+    switch ( _nk_format_string_prettify_inputs[prettify->type] )
+    {
+    case NK_FORMAT_STRING_PRETTIFY_INPUT_NONE:
+        g_return_if_reached();
+    case NK_FORMAT_STRING_PRETTIFY_INPUT_NUMBER:
+        if ( ! _nk_format_string_double_from_value(data, &number_value) )
+            return;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_INPUT_STRING:
+        if ( data->type != NK_FORMAT_STRING_VALUE_TYPE_STRING )
+            return;
+        string_value = data->data.string;
+    break;
+    }
+
+    switch ( prettify->type )
+    {
+    case NK_FORMAT_STRING_PRETTIFY_NONE:
+        g_return_if_reached();
+    case NK_FORMAT_STRING_PRETTIFY_FLOAT:
+    {
+        gint precision = prettify->precision;
+        if ( number_value == (gdouble) ( (gint64) number_value ) )
+            precision = MAX(0, precision);
+        _nk_format_string_append_double(string, number_value, prettify->width, precision, prettify->zero);
+    }
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_PREFIXES_SI:
+    {
+        const gchar **prefix;
+        if ( number_value == 0 )
+            prefix = _nk_format_string_prefixes_si_small; /* Empty string */
+        else if ( ( number_value > -1 ) && ( number_value < 1 ) )
+        {
+            for ( prefix = _nk_format_string_prefixes_si_small ; ( number_value > -1 ) && ( number_value < 1 ) && ( prefix < ( _nk_format_string_prefixes_si_small + G_N_ELEMENTS(_nk_format_string_prefixes_si_small) ) ) ; ++prefix )
+                number_value *= 1000;
+        }
+        else for ( prefix = _nk_format_string_prefixes_si_big ; ( number_value >= 1000 ) && ( prefix < ( _nk_format_string_prefixes_si_big + G_N_ELEMENTS(_nk_format_string_prefixes_si_big) ) ) ; ++prefix )
+            number_value /= 1000;
+        gint precision = prettify->precision;
+        if ( number_value == (gdouble) ( (gint64) number_value ) )
+            precision = MAX(0, precision);
+        _nk_format_string_append_double(string, number_value, prettify->width, precision, prettify->zero);
+        g_string_append(string, *prefix);
+    }
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_PREFIXES_BINARY:
+    {
+        const gchar **prefix;
+        for ( prefix = _nk_format_string_prefixes_binary ; ( number_value >= 1024 ) && ( prefix < ( _nk_format_string_prefixes_binary + G_N_ELEMENTS(_nk_format_string_prefixes_binary) ) ) ; ++prefix )
+            number_value /= 1024;
+        gint precision = prettify->precision;
+        if ( number_value == (gdouble) ( (gint64) number_value ) )
+            precision = MAX(0, precision);
+        _nk_format_string_append_double(string, number_value, prettify->width, precision, prettify->zero);
+        g_string_append(string, *prefix);
+    }
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_TIME:
+        _nk_format_string_append_time(string, (gint64) number_value, prettify, time_cache);
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION:
+    {
+        NkFormatStringPrettifyDurationData data = { .w = 0 };
+        guint64 s = (guint64) number_value;
+        number_value -= s;
+
+        if ( s > 604800 )
+        {
+            data.w = s / 604800;
+            s %= 604800;
+        }
+
+        if ( s > 86400 )
+        {
+            data.d = s / 86400;
+            s %= 86400;
+        }
+
+        if ( s > 3600 )
+        {
+            data.h = s / 3600;
+            s %= 3600;
+        }
+
+        if ( s > 60 )
+        {
+            data.m = s / 60;
+            s %= 60;
+        }
+
+        data.s = s;
+
+        if ( number_value >= 0.001 )
+        {
+            data.ms = (guint16) ( number_value * 1000 );
+            number_value -= ( data.ms / 1000. );
+        }
+
+        if ( number_value >= 0.000001 )
+        {
+            data.us = (guint16) ( number_value * 1000000 );
+            number_value -= ( data.us / 1000000. );
+        }
+
+        if ( number_value >= 0.000000001 )
+        {
+            data.ns = (guint16) ( number_value * 1000000000 );
+            number_value -= ( data.ns / 1000000000. );
+        }
+
+        NkFormatStringRenderContext context = {
+            .value_callback = _nk_format_string_prettify_duration_callback,
+            .user_data = &data,
+        };
+        _nk_format_string_replace(string, prettify->duration_format, &context);
+    }
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_JSON:
+        _nk_format_string_append_json(string, string_value);
+    break;
+    }
+}
+
+/* How arrays are rendered, from a [@joiner;start:end] key */
+typedef struct {
+    const gchar *joiner;
+    const NkFormatStringSlice *slice;
+} NkFormatStringJoin;
+
+/* Negative bounds count from the end, out of range ones are clamped */
+static gsize
+_nk_format_string_slice_bound(gint64 bound, gsize length)
+{
+    if ( bound < 0 )
+        return ( bound < -(gint64) length ) ? 0 : ( length + bound );
+    return MIN((guint64) bound, length);
+}
+
+static void _nk_format_string_append_array(GString *string, GVariant *data, const NkFormatStringJoin *join);
+
+static void
+_nk_format_string_append_variant_other(GString *string, GVariant *data, const NkFormatStringJoin *join)
+{
+    g_variant_print_string(data, string, FALSE);
+}
+
+static void
+_nk_format_string_append_variant_string(GString *string, GVariant *data, const NkFormatStringJoin *join)
+{
+    g_string_append(string, g_variant_get_string(data, NULL));
+}
+
+static void
+_nk_format_string_append_variant_boolean(GString *string, GVariant *data, const NkFormatStringJoin *join)
+{
+    g_string_append(string, g_variant_get_boolean(data) ? "true" : "false");
+}
+
+static void
+_nk_format_string_append_variant_double(GString *string, GVariant *data, const NkFormatStringJoin *join)
+{
+    _nk_format_string_append_double(string, g_variant_get_double(data), 0, 6, FALSE);
+}
+
+#define _nk_format_string_append_variant_define(l, kernel) \
+    static void \
+    _nk_format_string_append_variant_##l(GString *string, GVariant *data, const NkFormatStringJoin *join) \
+    { \
+        _nk_format_string_append_##kernel(string, g_variant_get_##l(data)); \
+    }
+
+_nk_format_string_append_variant_define(byte, uint64)
+_nk_format_string_append_variant_define(int16, int64)
+_nk_format_string_append_variant_define(uint16, uint64)
+_nk_format_string_append_variant_define(int32, int64)
+_nk_format_string_append_variant_define(uint32, uint64)
+_nk_format_string_append_variant_define(int64, int64)
+_nk_format_string_append_variant_define(uint64, uint64)
+
+#undef _nk_format_string_append_variant_define
+
+typedef void (*NkFormatStringAppendVariantFunc)(GString *string, GVariant *data, const NkFormatStringJoin *join);
+
+static const NkFormatStringAppendVariantFunc _nk_format_string_append_variant[NK_FORMAT_STRING_VARIANT_CLASS_SIZE] = {
+    [NK_FORMAT_STRING_VARIANT_CLASS_OTHER] = _nk_format_string_append_variant_other,
+    [NK_FORMAT_STRING_VARIANT_CLASS_STRING] = _nk_format_string_append_variant_string,
+    [NK_FORMAT_STRING_VARIANT_CLASS_BOOLEAN] = _nk_format_string_append_variant_boolean,
+    [NK_FORMAT_STRING_VARIANT_CLASS_BYTE] = _nk_format_string_append_variant_byte,
+    [NK_FORMAT_STRING_VARIANT_CLASS_INT16] = _nk_format_string_append_variant_int16,
+    [NK_FORMAT_STRING_VARIANT_CLASS_UINT16] = _nk_format_string_append_variant_uint16,
+    [NK_FORMAT_STRING_VARIANT_CLASS_INT32] = _nk_format_string_append_variant_int32,
+    [NK_FORMAT_STRING_VARIANT_CLASS_UINT32] = _nk_format_string_append_variant_uint32,
+    [NK_FORMAT_STRING_VARIANT_CLASS_INT64] = _nk_format_string_append_variant_int64,
+    [NK_FORMAT_STRING_VARIANT_CLASS_UINT64] = _nk_format_string_append_variant_uint64,
+    [NK_FORMAT_STRING_VARIANT_CLASS_DOUBLE] = _nk_format_string_append_variant_double,
+    [NK_FORMAT_STRING_VARIANT_CLASS_ARRAY] = _nk_format_string_append_array,
+    [NK_FORMAT_STRING_VARIANT_CLASS_VARIANT] = _nk_format_string_append_variant_other,
+};
+
+/*
+ * Arrays of basic types are read in bulk, without a #GVariant per element,
+ * and the output is reserved for the widest possible elements.
+ * The element type is classified once for the whole array.
+ */
+static void
+_nk_format_string_append_array(GString *string, GVariant *data, const NkFormatStringJoin *join)
+{
+    gsize length = g_variant_n_children(data);
+    gsize start = 0, end = length;
+    gsize i;
+
+    if ( ( join->slice != NULL ) && join->slice->sliced )
+    {
+        start = _nk_format_string_slice_bound(join->slice->start, length);
+        end = _nk_format_string_slice_bound(join->slice->end, length);
+    }
+    if ( start >= end )
+        return;
+
+    const gchar *joiner = join->joiner;
+    gsize jl = strlen(joiner);
+
+#define _nk_format_string_append_array_fixed(type, width, append) \
+    G_STMT_START { \
+        gsize n; \
+        const type *values = g_variant_get_fixed_array(data, &n, sizeof(type)); \
+        _nk_format_string_reserve(string, ( end - start ) * ( (width) + jl )); \
+        for ( i = start ; i < end ; ++i ) \
+        { \
+            if ( i > start ) \
+                g_string_append_len(string, joiner, jl); \
+            append; \
+        } \
+    } G_STMT_END
+
+    NkFormatStringVariantClass element_class = _nk_format_string_variant_class_from_char(g_variant_get_type_string(data)[1]);
+    switch ( element_class )
+    {
+    case NK_FORMAT_STRING_VARIANT_CLASS_STRING:
+    {
+        const gchar **values = g_variant_get_strv(data, NULL);
+        gsize size = ( end - start - 1 ) * jl;
+        for ( i = start ; i < end ; ++i )
+            size += strlen(values[i]);
+        _nk_format_string_reserve(string, size);
+        for ( i = start ; i < end ; ++i )
+        {
+            if ( i > start )
+                g_string_append_len(string, joiner, jl);
+            g_string_append(string, values[i]);
+        }
+        g_free(values);
+    }
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_BOOLEAN:
+        _nk_format_string_append_array_fixed(guchar, 5, g_string_append(string, values[i] ? "true" : "false"));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_BYTE:
+        _nk_format_string_append_array_fixed(guint8, 3, _nk_format_string_append_uint64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_INT16:
+        _nk_format_string_append_array_fixed(gint16, 6, _nk_format_string_append_int64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_UINT16:
+        _nk_format_string_append_array_fixed(guint16, 5, _nk_format_string_append_uint64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_INT32:
+        _nk_format_string_append_array_fixed(gint32, 11, _nk_format_string_append_int64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_UINT32:
+        _nk_format_string_append_array_fixed(guint32, 10, _nk_format_string_append_uint64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_INT64:
+        _nk_format_string_append_array_fixed(gint64, 20, _nk_format_string_append_int64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_UINT64:
+        _nk_format_string_append_array_fixed(guint64, 20, _nk_format_string_append_uint64(string, values[i]));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_DOUBLE:
+        /* Big values may need more, it is only a hint */
+        _nk_format_string_append_array_fixed(gdouble, 16, _nk_format_string_append_double(string, values[i], 0, 6, FALSE));
+    break;
+    case NK_FORMAT_STRING_VARIANT_CLASS_OTHER:
+    case NK_FORMAT_STRING_VARIANT_CLASS_ARRAY:
+    case NK_FORMAT_STRING_VARIANT_CLASS_VARIANT:
+    case NK_FORMAT_STRING_VARIANT_CLASS_SIZE:
+    {
+        /* Nested arrays are joined as a whole */
+        NkFormatStringAppendVariantFunc append = _nk_format_string_append_variant[element_class];
+        NkFormatStringJoin child_join = {
+            .joiner = joiner,
+        };
+        for ( i = start ; i < end ; ++i )
+        {
+            GVariant *child = g_variant_get_child_value(data, i);
+            if ( i > start )
+                g_string_append_len(string, joiner, jl);
+            append(string, child, &child_join);
+            g_variant_unref(child);
+        }
+    }
+    break;
+    }
+
+#undef _nk_format_string_append_array_fixed
+}
+
+static void
+_nk_format_string_append_data(GString *string, GVariant *data, const NkFormatStringJoin *join)
+{
+    _nk_format_string_append_variant[_nk_format_string_variant_classify(data)](string, data, join);
+}
+
+static void
+_nk_format_string_append_value(GString *string, const NkFormatStringValue *value, const NkFormatStringJoin *join)
+{
+    switch ( value->type )
+    {
+    case NK_FORMAT_STRING_VALUE_TYPE_NONE:
+    break;
+    case NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN:
+        g_string_append(string, value->data.boolean ? "true" : "false");
+    break;
+    case NK_FORMAT_STRING_VALUE_TYPE_INT64:
+        _nk_format_string_append_int64(string, value->data.int64);
+    break;
+    case NK_FORMAT_STRING_VALUE_TYPE_UINT64:
+        _nk_format_string_append_uint64(string, value->data.uint64);
+    break;
+    case NK_FORMAT_STRING_VALUE_TYPE_DOUBLE:
+        _nk_format_string_append_double(string, value->data.double_, 0, 6, FALSE);
+    break;
+    case NK_FORMAT_STRING_VALUE_TYPE_STRING:
+        g_string_append(string, value->data.string);
+    break;
+    case NK_FORMAT_STRING_VALUE_TYPE_VARIANT:
+        _nk_format_string_append_data(string, value->data.variant, join);
+    break;
+    }
+}
+
+typedef struct {
+    GPtrArray *buffers;
+    guint depth;
+} NkFormatStringScratch;
+
+static void
+_nk_format_string_scratch_buffer_free(gpointer buffer)
+{
+    g_string_free(buffer, TRUE);
+}
+
+static void
+_nk_format_string_scratch_free(gpointer data)
+{
+    NkFormatStringScratch *scratch = data;
+
+    g_ptr_array_unref(scratch->buffers);
+
+    g_free(scratch);
+}
+
+static GPrivate _nk_format_string_scratch = G_PRIVATE_INIT(_nk_format_string_scratch_free);
+
+/*
+ * Scratch buffers are kept per-thread and used as a stack,
+ * so nested renderings never allocate once warmed up
+ */
+static GString *
+_nk_format_string_scratch_get(void)
+{
+    NkFormatStringScratch *scratch = g_private_get(&_nk_format_string_scratch);
+    if ( scratch == NULL )
+    {
+        scratch = g_new0(NkFormatStringScratch, 1);
+        scratch->buffers = g_ptr_array_new_with_free_func(_nk_format_string_scratch_buffer_free);
+        g_private_set(&_nk_format_string_scratch, scratch);
+    }
+
+    if ( scratch->depth == scratch->buffers->len )
+        g_ptr_array_add(scratch->buffers, g_string_new(""));
+
+    GString *buffer = g_ptr_array_index(scratch->buffers, scratch->depth++);
+    g_string_truncate(buffer, 0);
+    return buffer;
+}
+
+static void
+_nk_format_string_scratch_release(guint count)
+{
+    NkFormatStringScratch *scratch = g_private_get(&_nk_format_string_scratch);
+    scratch->depth -= count;
+}
+
+static gboolean
+_nk_format_string_regex_replace(GString *string, const GRegex *regex, const GString *from, const gchar *replacement)
+{
+    /* Only escapes and references need expanding */
+    gboolean expand = ( strchr(replacement, '\\') != NULL );
+    if ( expand && ( ! g_regex_check_replacement(replacement, NULL, NULL) ) )
+        return FALSE;
+
+    GMatchInfo *match_info;
+    gsize p = 0;
+    g_regex_match_full(regex, from->str, from->len, 0, 0, &match_info, NULL);
+    while ( g_match_info_matches(match_info) )
+    {
+        gint s, e;
+        g_match_info_fetch_pos(match_info, 0, &s, &e);
+        g_string_append_len(string, from->str + p, s - p);
+        if ( expand )
+        {
+            gchar *tmp;
+            tmp = g_match_info_expand_references(match_info, replacement, NULL);
+            g_string_append(string, tmp);
+            g_free(tmp);
+        }
+        else
+            g_string_append(string, replacement);
+        p = e;
+        g_match_info_next(match_info, NULL);
+    }
+    g_string_append_len(string, from->str + p, from->len - p);
+    g_match_info_free(match_info);
+
+    return TRUE;
+}
+
+static const GRegex *
+_nk_format_string_regex_get(NkFormatStringRegex *regex)
+{
+    GRegex *compiled = g_atomic_pointer_get(&regex->regex);
+    if ( G_LIKELY(compiled != NULL) )
+        return compiled;
+
+    compiled = g_regex_new(regex->pattern, regex->flags, 0, NULL);
+    if ( compiled == NULL )
+        return NULL;
+    if ( ! g_atomic_pointer_compare_and_exchange(&regex->regex, NULL, compiled) )
+    {
+        /* Another thread was faster */
+        g_regex_unref(compiled);
+        compiled = g_atomic_pointer_get(&regex->regex);
+    }
+    return compiled;
+}
+
+#define NK_FORMAT_STRING_REPLACE_CACHE_DEFAULT_SIZE 8
+
+typedef struct {
+    gchar *data;
+    gsize length;
+    guint hash;
+} NkFormatStringReplaceCacheKey;
+
+typedef struct {
+    NkFormatStringReplaceCacheKey key;
+    GList link;
+    const gchar *result;
+    gsize length;
+} NkFormatStringReplaceCacheEntry;
+
+/*
+ * Each regex token memoizes its last results,
+ * keyed by the data and the replacement strings
+ */
+struct _NkFormatStringReplaceCache {
+    GMutex lock;
+    GHashTable *entries;
+    GQueue lru;
+};
+
+static guint _nk_format_string_replace_cache_size = NK_FORMAT_STRING_REPLACE_CACHE_DEFAULT_SIZE;
+
+static guint
+_nk_format_string_replace_cache_hash_data(const gchar *data, gsize length)
+{
+    /* Same as g_str_hash(), but with embedded nul bytes */
+    guint hash = 5381;
+    const gchar *e = data + length;
+    for ( ; data < e ; ++data )
+        hash = ( hash << 5 ) + hash + (guchar) *data;
+    return hash;
+}
+
+static guint
+_nk_format_string_replace_cache_key_hash(gconstpointer key_)
+{
+    const NkFormatStringReplaceCacheKey *key = key_;
+    return key->hash;
+}
+
+static gboolean
+_nk_format_string_replace_cache_key_equal(gconstpointer a_, gconstpointer b_)
+{
+    const NkFormatStringReplaceCacheKey *a = a_, *b = b_;
+    return ( a->hash == b->hash ) && ( a->length == b->length ) && ( memcmp(a->data, b->data, a->length) == 0 );
+}
+
+static void
+_nk_format_string_replace_cache_entry_free(gpointer data)
+{
+    NkFormatStringReplaceCacheEntry *entry = data;
+
+    /* The result lives in the key buffer */
+    g_free(entry->key.data);
+
+    g_free(entry);
+}
+
+static void
+_nk_format_string_replace_cache_free(NkFormatStringReplaceCache *cache)
+{
+    g_hash_table_unref(cache->entries);
+    g_mutex_clear(&cache->lock);
+
+    g_free(cache);
+}
+
+/* The cache is created on first use, as regexes may be */
+static NkFormatStringReplaceCache *
+_nk_format_string_replace_cache_get(NkFormatStringReplaceCache **cache_)
+{
+    NkFormatStringReplaceCache *cache = g_atomic_pointer_get(cache_);
+    if ( G_LIKELY(cache != NULL) )
+        return cache;
+
+    if ( g_atomic_int_get(&_nk_format_string_replace_cache_size) == 0 )
+        return NULL;
+
+    cache = g_new0(NkFormatStringReplaceCache, 1);
+    g_mutex_init(&cache->lock);
+    cache->entries = g_hash_table_new_full(_nk_format_string_replace_cache_key_hash, _nk_format_string_replace_cache_key_equal, NULL, _nk_format_string_replace_cache_entry_free);
+    g_queue_init(&cache->lru);
+    if ( ! g_atomic_pointer_compare_and_exchange(cache_, NULL, cache) )
+    {
+        /* Another thread was faster */
+        _nk_format_string_replace_cache_free(cache);
+        cache = g_atomic_pointer_get(cache_);
+    }
+    return cache;
+}
+
+static gboolean
+_nk_format_string_replace_cache_lookup(NkFormatStringReplaceCache *cache, const NkFormatStringReplaceCacheKey *key, GString *string)
+{
+    NkFormatStringReplaceCacheEntry *entry;
+
+    if ( g_atomic_int_get(&_nk_format_string_replace_cache_size) == 0 )
+        return FALSE;
+
+    g_mutex_lock(&cache->lock);
+    entry = g_hash_table_lookup(cache->entries, key);
+    if ( entry != NULL )
+    {
+        g_queue_unlink(&cache->lru, &entry->link);
+        g_queue_push_head_link(&cache->lru, &entry->link);
+        g_string_append_len(string, entry->result, entry->length);
+    }
+    g_mutex_unlock(&cache->lock);
+
+    return ( entry != NULL );
+}
+
+static void
+_nk_format_string_replace_cache_insert(NkFormatStringReplaceCache *cache, const NkFormatStringReplaceCacheKey *key, const GString *result)
+{
+    guint size = g_atomic_int_get(&_nk_format_string_replace_cache_size);
+
+    g_mutex_lock(&cache->lock);
+    if ( ( size > 0 ) && ( ! g_hash_table_contains(cache->entries, key) ) )
+    {
+        NkFormatStringReplaceCacheEntry *entry;
+        gchar *data;
+
+        data = g_new(gchar, key->length + result->len);
+        memcpy(data, key->data, key->length);
+        memcpy(data + key->length, result->str, result->len);
+
+        entry = g_new0(NkFormatStringReplaceCacheEntry, 1);
+        entry->key = *key;
+        entry->key.data = data;
+        entry->link.data = entry;
+        entry->result = data + key->length;
+        entry->length = result->len;
+
+        g_hash_table_insert(cache->entries, &entry->key, entry);
+        g_queue_push_head_link(&cache->lru, &entry->link);
+    }
+    while ( cache->lru.length > size )
+    {
+        GList *link = g_queue_pop_tail_link(&cache->lru);
+        NkFormatStringReplaceCacheEntry *entry = link->data;
+        g_hash_table_remove(cache->entries, &entry->key);
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+/**
+ * nk_format_string_replace_cache_set_size:
+ * @size: the maximum number of results kept per regex reference
+ *
+ * Each `${reference/regex/replacement}` reference remembers its last results,
+ * so that the same data with the same replacements skips the regexes entirely.
+ * This sets the number of results remembered for each of them,
+ * the least recently used ones being evicted first.
+ * A size of 0 disables the cache.
+ */
+NK_EXPORT void
+nk_format_string_replace_cache_set_size(gsize size)
+{
+    g_atomic_int_set(&_nk_format_string_replace_cache_size, MIN(size, G_MAXUINT));
+}
+
+static void
+_nk_format_string_append_replace(GString *string, const NkFormatStringValue *data, const NkFormatStringJoin *join, NkFormatStringRegex *regex, NkFormatStringReplaceCache **cache_, NkFormatStringRenderContext *context)
+{
+    NkFormatStringReplaceCache *cache;
+    NkFormatStringRegex *r;
+    GString *from, *to, *key;
+    gboolean ret = TRUE;
+
+    key = _nk_format_string_scratch_get();
+    from = _nk_format_string_scratch_get();
+    to = _nk_format_string_scratch_get();
+
+    /* The key is the data followed by all the replacements, nul-separated */
+    _nk_format_string_append_value(key, data, join);
+    gsize length = key->len;
+    for ( r = regex ; r->replacement != NULL ; ++r )
+    {
+        g_string_append_c(key, '\0');
+        _nk_format_string_run(key, r->replacement->program, r->replacement->program, NULL, context);
+    }
+
+    NkFormatStringReplaceCacheKey cache_key = {
+        .data = key->str,
+        .length = key->len,
+        .hash = _nk_format_string_replace_cache_hash_data(key->str, key->len),
+    };
+    cache = _nk_format_string_replace_cache_get(cache_);
+    if ( ( cache != NULL ) && _nk_format_string_replace_cache_lookup(cache, &cache_key, string) )
+        goto end;
+
+    const gchar *replacement = key->str + length;
+    g_string_append_len(from, key->str, length);
+    for ( r = regex ; ret && ( r->replacement != NULL ) ; ++r )
+    {
+        /* Skip the separator */
+        ++replacement;
+        gsize replacement_length = strlen(replacement);
+
+        g_string_truncate(to, 0);
+        if ( ( r->length > 0 ) && ( memchr(replacement, '\\', replacement_length) == NULL ) )
+            _nk_format_string_literal_replace(to, from->str, from->len, r->pattern, r->length, replacement, replacement_length);
+        else
+        {
+            const GRegex *compiled = _nk_format_string_regex_get(r);
+            if ( compiled == NULL )
+            {
+                ret = FALSE;
+                break;
+            }
+            ret = _nk_format_string_regex_replace(to, compiled, from, replacement);
+        }
+        replacement += replacement_length;
+
+        GString *tmp = from;
+        from = to;
+        to = tmp;
+    }
+    if ( ! ret )
+        goto end;
+
+    g_string_append_len(string, from->str, from->len);
+    if ( cache != NULL )
+        _nk_format_string_replace_cache_insert(cache, &cache_key, from);
+
+end:
+    _nk_format_string_scratch_release(3);
+}
+
+/* Literal chains need no intermediate buffer, not even for the data if it is a string */
+static void
+_nk_format_string_append_replace_chain(GString *string, const NkFormatStringValue *data, const NkFormatStringJoin *join, const NkFormatStringRegexChain *chain)
+{
+    if ( data->type == NK_FORMAT_STRING_VALUE_TYPE_STRING )
+    {
+        _nk_format_string_regex_chain_run(string, chain, data->data.string, strlen(data->data.string));
+        return;
+    }
+
+    GString *from;
+
+    from = _nk_format_string_scratch_get();
+    _nk_format_string_append_value(from, data, join);
+    _nk_format_string_regex_chain_run(string, chain, from->str, from->len);
+    _nk_format_string_scratch_release(1);
+}
+
+/*
+ * When writing to a sink, long literals are not copied but written
+ * from the format string itself, between the buffered dynamic parts.
+ * Short ones are cheaper to copy than to give their own vector.
+ */
+#define NK_FORMAT_STRING_WRITE_LITERAL_MIN_LENGTH 16
+
+static void
+_nk_format_string_write_literal(GString *string, const gchar *literal, gsize length, NkFormatStringRenderContext *context)
+{
+    NkFormatStringOutputVector vector;
+
+    if ( string->len > context->flushed )
+    {
+        /* Buffered, its address is only known once the buffer is complete */
+        vector.buffer = NULL;
+        vector.size = string->len - context->flushed;
+        g_array_append_val(context->vectors, vector);
+        context->flushed = string->len;
+    }
+
+    vector.buffer = literal;
+    vector.size = length;
+    g_array_append_val(context->vectors, vector);
+    context->written += length;
+}
+
+static NkFormatStringData *
+_nk_format_string_resolve(NkFormatStringRenderContext *context, const NkFormatStringOp *op)
+{
+    NkFormatStringData *data = &context->data[op->reference];
+    if ( ( context->resolved == NULL ) || context->resolved[op->reference] )
+        return data;
+    context->resolved[op->reference] = TRUE;
+
+    gint64 start = 0;
+    if ( G_UNLIKELY(context->profiled != NULL) )
+        start = _nk_format_string_profile_now();
+
+    if ( context->value_callback != NULL )
+    {
+        data->value.type = NK_FORMAT_STRING_VALUE_TYPE_NONE;
+        context->value_callback(op->token->name, op->token->value, &data->value, context->user_data);
+        if ( data->value.type == NK_FORMAT_STRING_VALUE_TYPE_VARIANT )
+            _nk_format_string_data_set_variant(data, ( data->value.data.variant != NULL ) ? g_variant_take_ref(data->value.data.variant) : NULL);
+    }
+    else
+    {
+        GVariant *variant;
+        variant = context->callback(op->token->name, op->token->value, context->user_data);
+        _nk_format_string_data_set_variant(data, ( variant != NULL ) ? g_variant_take_ref(variant) : NULL);
+    }
+
+    /* Regex replacement references count for the token they are in */
+    if ( G_UNLIKELY(context->profiled != NULL) )
+    {
+        guint64 elapsed = _nk_format_string_profile_now() - start;
+        context->counters[context->profiled - context->profile->program].callback_time += elapsed;
+        context->callback_time += elapsed;
+    }
+
+    return data;
+}
+
+/*
+ * Runs a whole top-level program token, from its FETCH op up to
+ * the end of its fallback or substitute, and counts it.
+ * Nested tokens are counted on their own, and in their parent too.
+ */
+static const NkFormatStringOp *
+_nk_format_string_run_profiled(GString *string, const NkFormatStringOp *program, const NkFormatStringOp *op, NkFormatStringRenderContext *context)
+{
+    NkFormatStringProfileCounters *counters = &context->counters[op - program];
+    const NkFormatStringOp *parent = context->profiled;
+    /* The FETCH op is always followed by its consuming op */
+    const NkFormatStringOp *end = program + MAX(op[0].jump, op[1].jump);
+    gsize length = string->len + context->written;
+    guint64 own_callback_time = counters->callback_time;
+    guint64 callback_time = context->callback_time;
+    gint64 start = _nk_format_string_profile_now();
+
+    context->profiled = op;
+    _nk_format_string_run(string, program, op, end, context);
+    context->profiled = parent;
+
+    /* Nested tokens callbacks are callback time for us too, not formatting */
+    callback_time = context->callback_time - callback_time;
+    own_callback_time = counters->callback_time - own_callback_time;
+    ++counters->calls;
+    counters->callback_time += callback_time - own_callback_time;
+    counters->format_time += ( _nk_format_string_profile_now() - start ) - callback_time;
+    counters->bytes += string->len + context->written - length;
+
+    return end;
+}
+
+/*
+ * Runs program from op until its END op, or until reaching end when non-%NULL.
+ * Top-level tokens never jump past their own ops, so op and end may be
+ * any segment boundaries.
+ */
+static void
+_nk_format_string_run(GString *string, const NkFormatStringOp *program, const NkFormatStringOp *op, const NkFormatStringOp *end, NkFormatStringRenderContext *context)
+{
+    NkFormatStringData data = { .variant = NULL };
+    NkFormatStringJoin join = { .joiner = ", " };
+
+    for (;;)
+    {
+        if ( op == end )
+            return;
+
+        const NkFormatStringToken *token = op->token;
+        switch ( op->code )
+        {
+        case NK_FORMAT_STRING_OP_END:
+            return;
+        case NK_FORMAT_STRING_OP_LITERAL:
+            if ( ( string == context->sink ) && ( op->length >= NK_FORMAT_STRING_WRITE_LITERAL_MIN_LENGTH ) )
+                _nk_format_string_write_literal(string, op->string, op->length, context);
+            else
+                g_string_append_len(string, op->string, op->length);
+            ++op;
+            continue;
+        case NK_FORMAT_STRING_OP_FETCH:
+        {
+            if ( G_UNLIKELY(context->profile != NULL) && ( op != context->profiled ) && ( program == context->profile->program ) )
+            {
+                op = _nk_format_string_run_profiled(string, program, op, context);
+                continue;
+            }
+
+            NkFormatStringData *source = _nk_format_string_resolve(context, op);
+            join.joiner = ", ";
+            join.slice = &_nk_format_string_token_modifiers(token)->slice;
+            if ( source->value.type == NK_FORMAT_STRING_VALUE_TYPE_VARIANT )
+                _nk_format_string_data_set_variant(&data, _nk_format_string_data_search(source, token->key, token->index, &join.joiner));
+            else
+                data.value = source->value;
+            if ( _nk_format_string_check_data(&data.value, token) )
+                ++op;
+            else
+            {
+                _nk_format_string_data_clear(&data);
+                op = program + op->jump;
+            }
+        }
+        continue;
+        case NK_FORMAT_STRING_OP_DROP:
+        break;
+        case NK_FORMAT_STRING_OP_DATA:
+            _nk_format_string_append_value(string, &data.value, &join);
+        break;
+        case NK_FORMAT_STRING_OP_RANGE:
+            _nk_format_string_append_range(string, &data.value, &token->modifiers->range);
+        break;
+        case NK_FORMAT_STRING_OP_SWITCH:
+            _nk_format_string_append_switch(string, &data.value, &token->modifiers->switch_);
+        break;
+        case NK_FORMAT_STRING_OP_PRETTIFY:
+            _nk_format_string_append_prettify(string, &data.value, &token->modifiers->prettify, &token->modifiers->time_cache);
+        break;
+        case NK_FORMAT_STRING_OP_REPLACE:
+            if ( token->modifiers->replace_chain != NULL )
+                _nk_format_string_append_replace_chain(string, &data.value, &join, token->modifiers->replace_chain);
+            else
+                _nk_format_string_append_replace(string, &data.value, &join, token->modifiers->replace, &token->modifiers->replace_cache, context);
+        break;
+        }
+        _nk_format_string_data_clear(&data);
+        op = program + op->jump;
+    }
+}
+
+#define NK_FORMAT_STRING_RENDER_STACK_SIZE 16
+
+static void
+_nk_format_string_replace(GString *string, const NkFormatString *self, NkFormatStringRenderContext *context)
+{
+    NkFormatStringData stack_data[NK_FORMAT_STRING_RENDER_STACK_SIZE] = { { .variant = NULL } };
+    gboolean stack_resolved[NK_FORMAT_STRING_RENDER_STACK_SIZE] = { FALSE };
+    GVariant *stack_variants[NK_FORMAT_STRING_RENDER_STACK_SIZE] = { NULL };
+    gsize i;
+
+    /* Each reference data is retrieved once and cached for the whole rendering */
+    if ( self->references_size > NK_FORMAT_STRING_RENDER_STACK_SIZE )
+    {
+        context->data = g_new0(NkFormatStringData, self->references_size);
+        context->resolved = g_new0(gboolean, self->references_size);
+    }
+    else
+    {
+        context->data = stack_data;
+        context->resolved = stack_resolved;
+    }
+
+    if ( context->references_callback != NULL )
+    {
+        if ( self->references_size > 0 )
+        {
+            GVariant **variants = stack_variants;
+            if ( self->references_size > NK_FORMAT_STRING_RENDER_STACK_SIZE )
+                variants = g_new0(GVariant *, self->references_size);
+            context->references_callback(self->references, self->references_size, variants, context->user_data);
+            for ( i = 0 ; i < self->references_size ; ++i )
+                _nk_format_string_data_set_variant(&context->data[i], ( variants[i] != NULL ) ? g_variant_take_ref(variants[i]) : NULL);
+            if ( variants != stack_variants )
+                g_free(variants);
+        }
+        if ( context->resolved != stack_resolved )
+            g_free(context->resolved);
+        context->resolved = NULL;
+    }
+
+    _nk_format_string_profile_start(self, context);
+    _nk_format_string_run(string, self->program, self->program, NULL, context);
+    if ( G_UNLIKELY(context->profile != NULL) )
+        _nk_format_string_profile_stop(context);
+
+    for ( i = 0 ; i < self->references_size ; ++i )
+        _nk_format_string_data_clear(&context->data[i]);
+    if ( context->data != stack_data )
+    {
+        g_free(context->data);
+        g_free(context->resolved);
+    }
+}
+
+/**
+ * NkFormatStringReplaceReferenceCallback:
+ * @name: the reference name
+ * @value: the reference value (for enum-based #NkFormatString only)
+ * @user_data: user_data passed to nk_format_string_replace()
+ *
+ * Retrieve the data referenced in the format string.
+ *
+ * The function should return a #GVariant containing the data referenced by name or value.
+ *
+ * The data is cached for the duration of one replacement,
+ * so the function is called at most once per distinct reference.
+ *
+ * If the return value is a floating reference (see g_variant_ref_sink()),
+ * the #NkFormatString takes ownership of it.
+ *
+ * Returns: (nullable): a #GVariant containing the referenced data, may be %NULL if no data
+ */
+/**
+ * nk_format_string_replace:
+ * @format_string: an #NkFormatString
+ * @callback: an #NkFormatStringReplaceReferenceCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Replaces all references in @format_string by data retrieved by @callback.
+ *
+ * See #NkFormatStringReplaceReferenceCallback.
+ *
+ * A replacement never changes what was parsed in @format_string,
+ * so this function is reentrant: the same @format_string can be
+ * rendered concurrently from several threads, as long as @callback
+ * can be called from these threads too.
+ * The same goes for all the other replacement functions.
+ * The only exceptions are per-token caches, the memo of a regex token
+ * and the last formatted time of a time prettifier: they are created lazily,
+ * on first use, with a compare-and-swap, so concurrent renders agree on
+ * a single one, and each lookup or update holds its lock.
+ * A formatted time is reused while the time stays in the same span
+ * (e.g. the same minute for "%H:%M"); the local timezone is only
+ * checked again once it leaves that span.
+ *
+ * Returns: the result string
+ */
+NK_EXPORT gchar *
+nk_format_string_replace(const NkFormatString *self, NkFormatStringReplaceReferenceCallback callback, gpointer user_data)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_return_val_if_fail(callback != NULL, NULL);
+
+    NkFormatStringRenderContext context = {
+        .callback = callback,
+        .user_data = user_data,
+    };
+    GString *string;
+    string = g_string_sized_new(self->length);
+
+    _nk_format_string_replace(string, self, &context);
+
+    return g_string_free(string, FALSE);
+}
+
+/**
+ * nk_format_string_replace_into:
+ * @format_string: an #NkFormatString
+ * @string: a #GString to append the result to
+ * @callback: an #NkFormatStringReplaceReferenceCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Replaces all references in @format_string by data retrieved by @callback,
+ * as nk_format_string_replace(), and appends the result to @string.
+ *
+ * Truncating @string before each call allows to reuse its buffer,
+ * which saves an allocation per call when rendering repeatedly.
+ */
+NK_EXPORT void
+nk_format_string_replace_into(const NkFormatString *self, GString *string, NkFormatStringReplaceReferenceCallback callback, gpointer user_data)
+{
+    g_return_if_fail(self != NULL);
+    g_return_if_fail(string != NULL);
+    g_return_if_fail(callback != NULL);
+
+    NkFormatStringRenderContext context = {
+        .callback = callback,
+        .user_data = user_data,
+    };
+    _nk_format_string_replace(string, self, &context);
+}
+
+/**
+ * NkFormatStringReference:
+ * @name: the reference name
+ * @value: the reference value (for enum-based #NkFormatString only)
+ *
+ * A reference used in a format string.
+ */
+/**
+ * nk_format_string_get_references:
+ * @format_string: an #NkFormatString
+ * @size: (out): return location for the number of references
+ *
+ * Retrieves the distinct references used in @format_string,
+ * including the ones in fallback, substitute and regex replacement strings.
+ *
+ * Returns: (array length=size) (transfer none): the references
+ */
+NK_EXPORT const NkFormatStringReference *
+nk_format_string_get_references(const NkFormatString *self, gsize *size)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_return_val_if_fail(size != NULL, NULL);
+
+    *size = self->references_size;
+    return self->references;
+}
+
+/**
+ * NkFormatStringTokenStats:
+ * @name: the reference name
+ * @key: (nullable): the reference key, empty for an index key
+ * @index: the reference index key
+ * @value: the reference value (for enum-based #NkFormatString only)
+ * @calls: the number of times the token was rendered
+ * @callback_time: the time spent retrieving its data, in nanoseconds
+ * @format_time: the time spent formatting its data, in nanoseconds
+ * @bytes: the number of bytes it produced
+ *
+ * Profiling counters of a reference token.
+ * Fallback and substitute tokens are also counted in their parent token.
+ */
+/**
+ * nk_format_string_set_profiling:
+ * @format_string: an #NkFormatString
+ * @profiling: whether to profile replacements
+ *
+ * Enables or disables the profiling of the replacements of @format_string,
+ * see nk_format_string_get_stats().
+ * Counters are kept when disabling, until nk_format_string_reset_stats().
+ *
+ * Render states from nk_format_string_render_state_new() are not profiled,
+ * and references retrieved with nk_format_string_replace_batch()
+ * have no callback time.
+ */
+NK_EXPORT void
+nk_format_string_set_profiling(NkFormatString *self, gboolean profiling)
+{
+    g_return_if_fail(self != NULL);
+
+    if ( ( ! profiling ) && ( g_atomic_pointer_get(&self->profile) == NULL ) )
+        return;
+
+    NkFormatStringProfile *profile = _nk_format_string_profile_get(self);
+    g_atomic_int_set(&profile->enabled, profiling);
+}
+
+/**
+ * nk_format_string_reset_stats:
+ * @format_string: an #NkFormatString
+ *
+ * Resets the profiling counters of @format_string.
+ */
+NK_EXPORT void
+nk_format_string_reset_stats(NkFormatString *self)
+{
+    g_return_if_fail(self != NULL);
+
+    NkFormatStringProfile *profile = g_atomic_pointer_get(&self->profile);
+    if ( profile == NULL )
+        return;
+
+    g_mutex_lock(&profile->lock);
+    profile->renders = 0;
+    memset(profile->counters, 0, profile->size * sizeof(NkFormatStringProfileCounters));
+    g_mutex_unlock(&profile->lock);
+}
+
+/**
+ * nk_format_string_get_stats:
+ * @format_string: an #NkFormatString
+ * @size: (out): return location for the number of tokens
+ * @renders: (out) (nullable): return location for the number of profiled replacements
+ *
+ * Retrieves the profiling counters of each reference token of @format_string,
+ * in order, see nk_format_string_set_profiling().
+ *
+ * Returns: (array length=size) (transfer container) (nullable): the counters, %NULL if @format_string was never profiled
+ */
+NK_EXPORT NkFormatStringTokenStats *
+nk_format_string_get_stats(const NkFormatString *self, gsize *size, guint64 *renders)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_return_val_if_fail(size != NULL, NULL);
+
+    NkFormatStringProfile *profile = g_atomic_pointer_get(&self->profile);
+    NkFormatStringTokenStats *stats;
+    gsize i;
+
+    *size = 0;
+    if ( renders != NULL )
+        *renders = 0;
+    if ( profile == NULL )
+        return NULL;
+
+    for ( i = 0 ; i < profile->size ; ++i )
+    {
+        if ( profile->program[i].code == NK_FORMAT_STRING_OP_FETCH )
+            ++*size;
+    }
+    stats = g_new(NkFormatStringTokenStats, *size);
+
+    g_mutex_lock(&profile->lock);
+    NkFormatStringTokenStats *token_stats = stats;
+    for ( i = 0 ; i < profile->size ; ++i )
+    {
+        const NkFormatStringOp *op = &profile->program[i];
+        if ( op->code != NK_FORMAT_STRING_OP_FETCH )
+            continue;
+
+        token_stats->name = op->token->name;
+        token_stats->key = op->token->key;
+        token_stats->index = op->token->index;
+        token_stats->value = op->token->value;
+        token_stats->calls = profile->counters[i].calls;
+        token_stats->callback_time = profile->counters[i].callback_time;
+        token_stats->format_time = profile->counters[i].format_time;
+        token_stats->bytes = profile->counters[i].bytes;
+        ++token_stats;
+    }
+    if ( renders != NULL )
+        *renders = profile->renders;
+    g_mutex_unlock(&profile->lock);
+
+    return stats;
+}
+
+/**
+ * nk_format_string_get_stats_json:
+ * @format_string: an #NkFormatString
+ *
+ * Dumps the profiling counters of @format_string as a JSON object,
+ * with the number of profiled replacements as `renders`
+ * and the counters of each token in the `tokens` array.
+ *
+ * Returns: (transfer full): the JSON string
+ */
+NK_EXPORT gchar *
+nk_format_string_get_stats_json(const NkFormatString *self)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+
+    NkFormatStringTokenStats *stats;
+    guint64 renders;
+    gsize size, i;
+    GString *string;
+
+    stats = nk_format_string_get_stats(self, &size, &renders);
+    string = g_string_new("");
+
+    g_string_append_printf(string, "{\"renders\":%" G_GUINT64_FORMAT ",\"tokens\":[", renders);
+    for ( i = 0 ; i < size ; ++i )
+    {
+        if ( i > 0 )
+            g_string_append_c(string, ',');
+        g_string_append(string, "{\"name\":\"");
+        _nk_format_string_append_json(string, stats[i].name);
+        g_string_append_c(string, '"');
+        if ( ( stats[i].key != NULL ) && ( *stats[i].key != '\0' ) )
+        {
+            g_string_append(string, ",\"key\":\"");
+            _nk_format_string_append_json(string, stats[i].key);
+            g_string_append_c(string, '"');
+        }
+        else if ( stats[i].key != NULL )
+            g_string_append_printf(string, ",\"key\":%" G_GINT64_FORMAT, stats[i].index);
+        g_string_append_printf(string, ",\"calls\":%" G_GUINT64_FORMAT ",\"callback-ns\":%" G_GUINT64_FORMAT ",\"format-ns\":%" G_GUINT64_FORMAT ",\"bytes\":%" G_GUINT64_FORMAT "}",
+            stats[i].calls, stats[i].callback_time, stats[i].format_time, stats[i].bytes);
+    }
+    g_string_append(string, "]}");
+
+    g_free(stats);
+    return g_string_free(string, FALSE);
+}
+
+/**
+ * NkFormatStringOutputVector:
+ * @buffer: the data to write
+ * @size: the size of @buffer
+ *
+ * A piece of the result passed to #NkFormatStringWriteCallback.
+ * It has the same layout as #GOutputVector and `struct iovec`.
+ */
+/**
+ * NkFormatStringWriteCallback:
+ * @vectors: (array length=size): the pieces of the result, in order
+ * @size: the number of pieces
+ * @user_data: user_data passed to nk_format_string_replace_write()
+ * @error: return location for a #GError
+ *
+ * Writes the result of a replacement.
+ *
+ * The function should write all of @vectors.
+ * To write to a #GOutputStream, @vectors can be passed
+ * to g_output_stream_writev_all() as #GOutputVector.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ */
+/**
+ * nk_format_string_replace_write:
+ * @format_string: an #NkFormatString
+ * @callback: an #NkFormatStringReplaceReferenceCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ * @write_callback: an #NkFormatStringWriteCallback to write the result
+ * @write_user_data: user_data for @write_callback
+ * @error: return location for a #GError
+ *
+ * Replaces all references in @format_string by data retrieved by @callback,
+ * as nk_format_string_replace(), and writes the result with @write_callback.
+ *
+ * Only the replaced parts of the result are buffered, the literal parts
+ * are written straight from @format_string and @write_callback is called once.
+ *
+ * Returns: %TRUE on success, %FALSE if @write_callback failed
+ */
+NK_EXPORT gboolean
+nk_format_string_replace_write(const NkFormatString *self, NkFormatStringReplaceReferenceCallback callback, gpointer user_data, NkFormatStringWriteCallback write_callback, gpointer write_user_data, GError **error)
+{
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(callback != NULL, FALSE);
+    g_return_val_if_fail(write_callback != NULL, FALSE);
+    g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+    NkFormatStringRenderContext context = {
+        .callback = callback,
+        .user_data = user_data,
+    };
+    NkFormatStringOutputVector *vectors;
+    gsize i, offset = 0;
+    gboolean ret;
+
+    context.sink = _nk_format_string_scratch_get();
+    context.vectors = g_array_sized_new(FALSE, FALSE, sizeof(NkFormatStringOutputVector), 16);
+    _nk_format_string_replace(context.sink, self, &context);
+
+    if ( context.sink->len > context.flushed )
+    {
+        NkFormatStringOutputVector vector = {
+            .buffer = NULL,
+            .size = context.sink->len - context.flushed,
+        };
+        g_array_append_val(context.vectors, vector);
+    }
+
+    vectors = (NkFormatStringOutputVector *) context.vectors->data;
+    for ( i = 0 ; i < context.vectors->len ; ++i )
+    {
+        if ( vectors[i].buffer != NULL )
+            continue;
+        vectors[i].buffer = context.sink->str + offset;
+        offset += vectors[i].size;
+    }
+
+    ret = write_callback(vectors, context.vectors->len, write_user_data, error);
+
+    g_array_free(context.vectors, TRUE);
+    _nk_format_string_scratch_release(1);
+
+    return ret;
+}
+
+#ifdef G_OS_UNIX
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif /* ! IOV_MAX */
+
+static gboolean
+_nk_format_string_write_fd(const NkFormatStringOutputVector *vectors_, gsize size, gpointer user_data, GError **error)
+{
+    G_STATIC_ASSERT(sizeof(struct iovec) == sizeof(NkFormatStringOutputVector));
+
+    gint fd = GPOINTER_TO_INT(user_data);
+    struct iovec stack_vectors[64];
+    struct iovec *vectors = ( size > G_N_ELEMENTS(stack_vectors) ) ? g_new(struct iovec, size) : stack_vectors;
+    gboolean ret = TRUE;
+    gsize i = 0;
+
+    /* We need to update them on partial writes */
+    memcpy(vectors, vectors_, size * sizeof(struct iovec));
+    while ( i < size )
+    {
+        gssize written = writev(fd, vectors + i, MIN(size - i, IOV_MAX));
+        if ( written < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            gint errsv = errno;
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errsv), "Could not write: %s", g_strerror(errsv));
+            ret = FALSE;
+            break;
+        }
+
+        /* Skip what was written, resume in the middle of a vector if needed */
+        for ( ; ( i < size ) && ( (gsize) written >= vectors[i].iov_len ) ; ++i )
+            written -= vectors[i].iov_len;
+        if ( i < size )
+        {
+            vectors[i].iov_base = (gchar *) vectors[i].iov_base + written;
+            vectors[i].iov_len -= written;
+        }
+    }
+
+    if ( vectors != stack_vectors )
+        g_free(vectors);
+
+    return ret;
+}
+
+/**
+ * nk_format_string_replace_fd:
+ * @format_string: an #NkFormatString
+ * @fd: a file descriptor to write the result to
+ * @callback: an #NkFormatStringReplaceReferenceCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ * @error: return location for a #GError
+ *
+ * Replaces all references in @format_string by data retrieved by @callback,
+ * as nk_format_string_replace(), and writes the result to @fd.
+ *
+ * See nk_format_string_replace_write(), the result is written with writev(),
+ * usually in a single system call.
+ *
+ * Returns: %TRUE on success, %FALSE on error (in the #G_FILE_ERROR domain)
+ */
+NK_EXPORT gboolean
+nk_format_string_replace_fd(const NkFormatString *self, gint fd, NkFormatStringReplaceReferenceCallback callback, gpointer user_data, GError **error)
+{
+    g_return_val_if_fail(fd >= 0, FALSE);
+
+    return nk_format_string_replace_write(self, callback, user_data, _nk_format_string_write_fd, GINT_TO_POINTER(fd), error);
+}
+#endif /* G_OS_UNIX */
+
+/**
+ * NkFormatStringReplaceReferencesCallback:
+ * @references: (array length=size): the references used in the format string
+ * @size: the number of references
+ * @data: (array length=size) (out caller-allocates): return location for the data, one per reference
+ * @user_data: user_data passed to nk_format_string_replace_batch()
+ *
+ * Retrieve all the data referenced in the format string at once.
+ *
+ * The function should fill @data with a #GVariant for each entry of @references,
+ * at the same index, or %NULL if there is no data.
+ * As with #NkFormatStringReplaceReferenceCallback, the #NkFormatString takes ownership of the data.
+ */
+/**
+ * nk_format_string_replace_batch:
+ * @format_string: an #NkFormatString
+ * @callback: an #NkFormatStringReplaceReferencesCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Replaces all references in @format_string by data retrieved by @callback.
+ *
+ * @callback is called exactly once with all the references of @format_string,
+ * as returned by nk_format_string_get_references().
+ *
+ * Returns: the result string
+ */
+NK_EXPORT gchar *
+nk_format_string_replace_batch(const NkFormatString *self, NkFormatStringReplaceReferencesCallback callback, gpointer user_data)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_return_val_if_fail(callback != NULL, NULL);
+
+    NkFormatStringRenderContext context = {
+        .references_callback = callback,
+        .user_data = user_data,
+    };
+    GString *string;
+    string = g_string_sized_new(self->length);
+
+    _nk_format_string_replace(string, self, &context);
+
+    return g_string_free(string, FALSE);
+}
+
+/**
+ * nk_format_string_replace_batch_into:
+ * @format_string: an #NkFormatString
+ * @string: a #GString to append the result to
+ * @callback: an #NkFormatStringReplaceReferencesCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Replaces all references in @format_string by data retrieved by @callback,
+ * as nk_format_string_replace_batch(), and appends the result to @string.
+ */
+NK_EXPORT void
+nk_format_string_replace_batch_into(const NkFormatString *self, GString *string, NkFormatStringReplaceReferencesCallback callback, gpointer user_data)
+{
+    g_return_if_fail(self != NULL);
+    g_return_if_fail(string != NULL);
+    g_return_if_fail(callback != NULL);
+
+    NkFormatStringRenderContext context = {
+        .references_callback = callback,
+        .user_data = user_data,
+    };
+    _nk_format_string_replace(string, self, &context);
+}
+
+/**
+ * NkFormatStringValueType:
+ * @NK_FORMAT_STRING_VALUE_TYPE_NONE: No data
+ * @NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN: A boolean, in @data.boolean
+ * @NK_FORMAT_STRING_VALUE_TYPE_INT64: A signed integer, in @data.int64
+ * @NK_FORMAT_STRING_VALUE_TYPE_UINT64: An unsigned integer, in @data.uint64
+ * @NK_FORMAT_STRING_VALUE_TYPE_DOUBLE: A floating point number, in @data.double_
+ * @NK_FORMAT_STRING_VALUE_TYPE_STRING: A UTF-8 string, in @data.string
+ * @NK_FORMAT_STRING_VALUE_TYPE_VARIANT: Any other data, as a #GVariant in @data.variant
+ *
+ * The type of an #NkFormatStringValue.
+ */
+/**
+ * NkFormatStringValue:
+ * @type: the #NkFormatStringValueType of the data
+ *
+ * Data for a reference, as used by #NkFormatStringReplaceValueCallback.
+ *
+ * The string of a %NK_FORMAT_STRING_VALUE_TYPE_STRING value is not copied
+ * and must stay valid until the replacement ends.
+ * The #GVariant of a %NK_FORMAT_STRING_VALUE_TYPE_VARIANT value is handled
+ * as the return value of #NkFormatStringReplaceReferenceCallback.
+ */
+/**
+ * NkFormatStringReplaceValueCallback:
+ * @name: the reference name
+ * @value: the reference value (for enum-based #NkFormatString only)
+ * @data: (out caller-allocates): return location for the data
+ * @user_data: user_data passed to nk_format_string_replace_values()
+ *
+ * Retrieve the data referenced in the format string, as a typed value.
+ *
+ * @data is initialized with the %NK_FORMAT_STRING_VALUE_TYPE_NONE type,
+ * which means no data.
+ *
+ * Scalar values are used directly, without going through #GVariant.
+ */
+/**
+ * nk_format_string_replace_values:
+ * @format_string: an #NkFormatString
+ * @callback: an #NkFormatStringReplaceValueCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Replaces all references in @format_string by data retrieved by @callback.
+ *
+ * Returns: the result string
+ */
+NK_EXPORT gchar *
+nk_format_string_replace_values(const NkFormatString *self, NkFormatStringReplaceValueCallback callback, gpointer user_data)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_return_val_if_fail(callback != NULL, NULL);
+
+    NkFormatStringRenderContext context = {
+        .value_callback = callback,
+        .user_data = user_data,
+    };
+    GString *string;
+    string = g_string_sized_new(self->length);
+
+    _nk_format_string_replace(string, self, &context);
+
+    return g_string_free(string, FALSE);
+}
+
+/**
+ * nk_format_string_replace_values_into:
+ * @format_string: an #NkFormatString
+ * @string: a #GString to append the result to
+ * @callback: an #NkFormatStringReplaceValueCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Replaces all references in @format_string by data retrieved by @callback,
+ * as nk_format_string_replace_values(), and appends the result to @string.
+ */
+NK_EXPORT void
+nk_format_string_replace_values_into(const NkFormatString *self, GString *string, NkFormatStringReplaceValueCallback callback, gpointer user_data)
+{
+    g_return_if_fail(self != NULL);
+    g_return_if_fail(string != NULL);
+    g_return_if_fail(callback != NULL);
+
+    NkFormatStringRenderContext context = {
+        .value_callback = callback,
+        .user_data = user_data,
+    };
+    _nk_format_string_replace(string, self, &context);
+}
+
+struct _NkFormatStringRenderState {
+    NkFormatString *format_string;
+    NkFormatStringData *data;
+    gboolean *invalid;
+    gsize *dependents;
+    gsize *dependents_index;
+    GString **segments;
+    gboolean *dirty;
+    GString *string;
+};
+
+static void
+_nk_format_string_render_state_collect(const NkFormatStringOp *op, const NkFormatStringOp *end, gboolean *references)
+{
+    for ( ; ( op != end ) && ( op->code != NK_FORMAT_STRING_OP_END ) ; ++op )
+    {
+        if ( op->code == NK_FORMAT_STRING_OP_FETCH )
+            references[op->reference] = TRUE;
+        else if ( op->code == NK_FORMAT_STRING_OP_REPLACE )
+        {
+            const NkFormatStringRegex *regex;
+            for ( regex = op->token->modifiers->replace ; regex->replacement != NULL ; ++regex )
+                _nk_format_string_render_state_collect(regex->replacement->program, NULL, references);
+        }
+    }
+}
+
+/**
+ * nk_format_string_render_state_new:
+ * @format_string: an #NkFormatString
+ *
+ * Creates a render state for @format_string, to render it incrementally.
+ *
+ * The state keeps the last data of each reference and the last output
+ * of each top-level token.
+ * Once a reference is invalidated, only the tokens depending on it,
+ * including through fallback, substitute or regex replacement
+ * sub-formats, are rendered again, and only if its data changed.
+ *
+ * Unlike @format_string, the state must not be used from several threads at once.
+ *
+ * Returns: (transfer full): an #NkFormatStringRenderState
+ */
+NK_EXPORT NkFormatStringRenderState *
+nk_format_string_render_state_new(NkFormatString *format_string)
+{
+    g_return_val_if_fail(format_string != NULL, NULL);
+
+    NkFormatStringRenderState *self;
+    gsize references_size = format_string->references_size;
+    gsize segments_size = format_string->segments_size;
+    gsize i, r;
+
+    self = g_new0(NkFormatStringRenderState, 1);
+    self->format_string = nk_format_string_ref(format_string);
+    self->data = g_new0(NkFormatStringData, references_size);
+    self->invalid = g_new(gboolean, references_size);
+    self->segments = g_new(GString *, segments_size);
+    self->dirty = g_new(gboolean, segments_size);
+    self->string = g_string_sized_new(format_string->length);
+
+    for ( r = 0 ; r < references_size ; ++r )
+        self->invalid[r] = TRUE;
+    for ( i = 0 ; i < segments_size ; ++i )
+    {
+        self->segments[i] = g_string_new("");
+        self->dirty[i] = TRUE;
+    }
+
+    /* Build the reference → segments index, counting first */
+    gboolean *depends = g_new0(gboolean, segments_size * references_size);
+    self->dependents_index = g_new0(gsize, references_size + 1);
+    for ( i = 0 ; i < segments_size ; ++i )
+    {
+        gboolean *segment_depends = depends + i * references_size;
+        _nk_format_string_render_state_collect(format_string->program + format_string->segments[i], format_string->program + format_string->segments[i + 1], segment_depends);
+        for ( r = 0 ; r < references_size ; ++r )
+        {
+            if ( segment_depends[r] )
+                ++self->dependents_index[r + 1];
+        }
+    }
+    for ( r = 0 ; r < references_size ; ++r )
+        self->dependents_index[r + 1] += self->dependents_index[r];
+
+    gsize *fill = g_new(gsize, references_size + 1);
+    memcpy(fill, self->dependents_index, ( references_size + 1 ) * sizeof(gsize));
+    self->dependents = g_new(gsize, self->dependents_index[references_size]);
+    for ( i = 0 ; i < segments_size ; ++i )
+    {
+        for ( r = 0 ; r < references_size ; ++r )
+        {
+            if ( depends[i * references_size + r] )
+                self->dependents[fill[r]++] = i;
+        }
+    }
+    g_free(fill);
+    g_free(depends);
+
+    return self;
+}
+
+/**
+ * nk_format_string_render_state_free:
+ * @state: an #NkFormatStringRenderState
+ *
+ * Frees @state.
+ */
+NK_EXPORT void
+nk_format_string_render_state_free(NkFormatStringRenderState *self)
+{
+    g_return_if_fail(self != NULL);
+
+    gsize i;
+    for ( i = 0 ; i < self->format_string->references_size ; ++i )
+        _nk_format_string_data_clear(&self->data[i]);
+    for ( i = 0 ; i < self->format_string->segments_size ; ++i )
+        g_string_free(self->segments[i], TRUE);
+
+    g_string_free(self->string, TRUE);
+    g_free(self->dirty);
+    g_free(self->segments);
+    g_free(self->dependents);
+    g_free(self->dependents_index);
+    g_free(self->invalid);
+    g_free(self->data);
+
+    nk_format_string_unref(self->format_string);
+
+    g_free(self);
+}
+
+/**
+ * nk_format_string_render_state_invalidate:
+ * @state: an #NkFormatStringRenderState
+ * @name: a reference name
+ *
+ * Marks the data of the reference @name as changed.
+ * It will be retrieved again by the next nk_format_string_render_state_replace().
+ */
+NK_EXPORT void
+nk_format_string_render_state_invalidate(NkFormatStringRenderState *self, const gchar *name)
+{
+    g_return_if_fail(self != NULL);
+    g_return_if_fail(name != NULL);
+
+    gsize i;
+    for ( i = 0 ; i < self->format_string->references_size ; ++i )
+    {
+        if ( g_strcmp0(self->format_string->references[i].name, name) == 0 )
+            self->invalid[i] = TRUE;
+    }
+}
+
+/**
+ * nk_format_string_render_state_invalidate_value:
+ * @state: an #NkFormatStringRenderState
+ * @value: a reference value
+ *
+ * Marks the data of the reference @value as changed,
+ * for a state created from an enum-based #NkFormatString.
+ * It will be retrieved again by the next nk_format_string_render_state_replace().
+ */
+NK_EXPORT void
+nk_format_string_render_state_invalidate_value(NkFormatStringRenderState *self, guint64 value)
+{
+    g_return_if_fail(self != NULL);
+
+    gsize i;
+    for ( i = 0 ; i < self->format_string->references_size ; ++i )
+    {
+        if ( self->format_string->references[i].value == value )
+            self->invalid[i] = TRUE;
+    }
+}
+
+/**
+ * nk_format_string_render_state_invalidate_all:
+ * @state: an #NkFormatStringRenderState
+ *
+ * Marks the data of all the references as changed.
+ */
+NK_EXPORT void
+nk_format_string_render_state_invalidate_all(NkFormatStringRenderState *self)
+{
+    g_return_if_fail(self != NULL);
+
+    gsize i;
+    for ( i = 0 ; i < self->format_string->references_size ; ++i )
+        self->invalid[i] = TRUE;
+}
+
+static gboolean
+_nk_format_string_data_equal(const NkFormatStringData *a, const NkFormatStringData *b)
+{
+    if ( ( a->variant == NULL ) || ( b->variant == NULL ) )
+        return ( a->variant == b->variant );
+    return g_variant_equal(a->variant, b->variant);
+}
+
+/**
+ * nk_format_string_render_state_replace:
+ * @state: an #NkFormatStringRenderState
+ * @callback: an #NkFormatStringReplaceReferenceCallback used to retrieve replacement data
+ * @user_data: user_data for @callback
+ *
+ * Retrieves the data of the invalidated references with @callback
+ * and renders again the parts of the format string depending on them.
+ *
+ * The first call renders the whole format string.
+ *
+ * Returns: (transfer none): the result string, owned by @state and valid until the next call
+ */
+NK_EXPORT const gchar *
+nk_format_string_render_state_replace(NkFormatStringRenderState *self, NkFormatStringReplaceReferenceCallback callback, gpointer user_data)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    g_return_val_if_fail(callback != NULL, NULL);
+
+    const NkFormatString *format_string = self->format_string;
+    gboolean changed = FALSE;
+    gsize i, d;
+
+    for ( i = 0 ; i < format_string->references_size ; ++i )
+    {
+        if ( ! self->invalid[i] )
+            continue;
+        self->invalid[i] = FALSE;
+
+        NkFormatStringData data;
+        GVariant *variant;
+        variant = callback(format_string->references[i].name, format_string->references[i].value, user_data);
+        _nk_format_string_data_set_variant(&data, ( variant != NULL ) ? g_variant_take_ref(variant) : NULL);
+        if ( _nk_format_string_data_equal(&data, &self->data[i]) )
+        {
+            _nk_format_string_data_clear(&data);
+            continue;
+        }
+
+        _nk_format_string_data_clear(&self->data[i]);
+        self->data[i] = data;
+        for ( d = self->dependents_index[i] ; d < self->dependents_index[i + 1] ; ++d )
+            self->dirty[self->dependents[d]] = TRUE;
+    }
+
+    NkFormatStringRenderContext context = {
+        .callback = callback,
+        .user_data = user_data,
+        .data = self->data,
+        .resolved = NULL,
+    };
+    for ( i = 0 ; i < format_string->segments_size ; ++i )
+    {
+        if ( ! self->dirty[i] )
+            continue;
+        self->dirty[i] = FALSE;
+        changed = TRUE;
+
+        g_string_truncate(self->segments[i], 0);
+        _nk_format_string_run(self->segments[i], format_string->program, format_string->program + format_string->segments[i], format_string->program + format_string->segments[i + 1], &context);
+    }
+
+    if ( changed )
+    {
+        g_string_truncate(self->string, 0);
+        for ( i = 0 ; i < format_string->segments_size ; ++i )
+            g_string_append_len(self->string, self->segments[i]->str, self->segments[i]->len);
+    }
+
+    return self->string->str;
+}
+
+#define NK_FORMAT_STRING_BLOB_MAGIC "nkutils-format-string"
+#define NK_FORMAT_STRING_BLOB_VERSION 2
+#define NK_FORMAT_STRING_BLOB_TOKEN_TYPE "(msmsmsxtii(ddas)msms(bxx)(ybiimsi)a(sui)b)"
+#define NK_FORMAT_STRING_BLOB_TYPE "(sua(ta" NK_FORMAT_STRING_BLOB_TOKEN_TYPE "))"
+
+/*
+ * Format strings are stored in a flat list, the top-level one first.
+ * Sub-formats are referenced by their index, always after their parent.
+ */
+static gint32
+_nk_format_string_save_format(GPtrArray *formats, const NkFormatString *self)
+{
+    if ( self == NULL )
+        return -1;
+
+    gint32 index = formats->len;
+    g_ptr_array_add(formats, NULL);
+
+    GVariantBuilder tokens;
+    g_variant_builder_init(&tokens, G_VARIANT_TYPE("a" NK_FORMAT_STRING_BLOB_TOKEN_TYPE));
+
+    gsize i;
+    for ( i = 0 ; i < self->size ; ++i )
+    {
+        const NkFormatStringToken *token = &self->tokens[i];
+        const NkFormatStringTokenModifiers *modifiers = _nk_format_string_token_modifiers(token);
+        gchar *string = ( token->string != NULL ) ? g_strndup(token->string, token->length) : NULL;
+        gint32 fallback = _nk_format_string_save_format(formats, modifiers->fallback);
+        gint32 substitute = _nk_format_string_save_format(formats, modifiers->substitute);
+        gint32 duration_format = _nk_format_string_save_format(formats, modifiers->prettify.duration_format);
+
+        GVariantBuilder replace;
+        g_variant_builder_init(&replace, G_VARIANT_TYPE("a(sui)"));
+        if ( modifiers->replace != NULL )
+        {
+            NkFormatStringRegex *regex;
+            for ( regex = modifiers->replace ; regex->replacement != NULL ; ++regex )
+                g_variant_builder_add(&replace, "(sui)", regex->pattern, (guint32) regex->flags, _nk_format_string_save_format(formats, regex->replacement));
+        }
+
+        g_variant_builder_add(&tokens, "(msmsmsxtii(dd@as)msms(bxx)(ybiimsi)a(sui)b)",
+            string, token->name, token->key, token->index, token->value,
+            fallback, substitute,
+            modifiers->range.min, modifiers->range.max, g_variant_new_strv((const gchar * const *) modifiers->range.values, modifiers->range.length),
+            modifiers->switch_.true_, modifiers->switch_.false_,
+            modifiers->slice.sliced, modifiers->slice.start, modifiers->slice.end,
+            (guchar) modifiers->prettify.type, modifiers->prettify.zero, modifiers->prettify.width, modifiers->prettify.precision, modifiers->prettify.time_format, duration_format,
+            &replace,
+            token->no_data);
+        g_free(string);
+    }
+
+    formats->pdata[index] = g_variant_ref_sink(g_variant_new("(ta" NK_FORMAT_STRING_BLOB_TOKEN_TYPE ")", (guint64) self->length, &tokens));
+
+    return index;
+}
+
+/**
+ * nk_format_string_save:
+ * @format_string: an #NkFormatString
+ *
+ * Serializes @format_string to a versioned binary blob,
+ * to be loaded back with nk_format_string_load().
+ *
+ * The blob is meant as a cache: it may only be loaded back
+ * by the same version of the library.
+ *
+ * Returns: (transfer full): a #GBytes
+ */
+NK_EXPORT GBytes *
+nk_format_string_save(const NkFormatString *self)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+
+    GPtrArray *formats;
+    GVariant *blob;
+    GBytes *bytes;
+
+    formats = g_ptr_array_new_with_free_func((GDestroyNotify) g_variant_unref);
+    _nk_format_string_save_format(formats, self);
+
+    blob = g_variant_new("(su@a(ta" NK_FORMAT_STRING_BLOB_TOKEN_TYPE "))", NK_FORMAT_STRING_BLOB_MAGIC, NK_FORMAT_STRING_BLOB_VERSION, g_variant_new_array(G_VARIANT_TYPE("(ta" NK_FORMAT_STRING_BLOB_TOKEN_TYPE ")"), (GVariant * const *) formats->pdata, formats->len));
+    g_variant_ref_sink(blob);
+    g_ptr_array_unref(formats);
+
+    bytes = g_variant_get_data_as_bytes(blob);
+    g_variant_unref(blob);
+
+    return bytes;
+}
+
+typedef struct {
+    NkFormatString *root;
+    GVariant *formats;
+    gsize size;
+    gboolean *loaded;
+    GError **error;
+} NkFormatStringLoadContext;
+
+static gboolean _nk_format_string_load_format(NkFormatStringLoadContext *context, gint32 parent, gint32 index, gboolean optional, NkFormatString **ret);
+
+static gboolean
+_nk_format_string_load_token(NkFormatStringLoadContext *context, NkFormatString *self, gint32 parent, GVariant *variant, NkFormatStringToken *token)
+{
+    NkFormatStringTokenModifiers modifiers = { .fallback = NULL };
+    gint32 fallback, substitute, duration_format;
+    const gchar **values;
+    guchar prettify_type;
+    gboolean zero;
+    GVariantIter *replace;
+
+    g_variant_get(variant, "(m&sm&sm&sxtii(dd^a&s)m&sm&s(bxx)(ybiim&si)a(sui)b)",
+        &token->string, &token->name, &token->key, &token->index, &token->value,
+        &fallback, &substitute,
+        &modifiers.range.min, &modifiers.range.max, &values,
+        &modifiers.switch_.true_, &modifiers.switch_.false_,
+        &modifiers.slice.sliced, &modifiers.slice.start, &modifiers.slice.end,
+        &prettify_type, &zero, &modifiers.prettify.width, &modifiers.prettify.precision, &modifiers.prettify.time_format, &duration_format,
+        &replace,
+        &token->no_data);
+    modifiers.range.length = g_strv_length((gchar **) values);
+    if ( modifiers.range.length > 0 )
+    {
+        modifiers.range.values = _nk_format_string_alloc(self, gchar *, modifiers.range.length);
+        memcpy(modifiers.range.values, values, modifiers.range.length * sizeof(gchar *));
+    }
+    g_free(values);
+    if ( token->string != NULL )
+        token->length = strlen(token->string);
+
+    gboolean ret = FALSE;
+    if ( ( token->string == NULL ) == ( token->name == NULL ) )
+        goto error;
+    if ( ( modifiers.switch_.true_ == NULL ) != ( modifiers.switch_.false_ == NULL ) )
+        goto error;
+
+    modifiers.prettify.type = prettify_type;
+    switch ( modifiers.prettify.type )
+    {
+    case NK_FORMAT_STRING_PRETTIFY_NONE:
+    case NK_FORMAT_STRING_PRETTIFY_JSON:
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_FLOAT:
+    case NK_FORMAT_STRING_PRETTIFY_PREFIXES_SI:
+    case NK_FORMAT_STRING_PRETTIFY_PREFIXES_BINARY:
+        modifiers.prettify.zero = zero;
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_TIME:
+        if ( modifiers.prettify.time_format == NULL )
+            goto error;
+        modifiers.prettify.time_granularity = _nk_format_string_time_format_granularity(modifiers.prettify.time_format);
+    break;
+    case NK_FORMAT_STRING_PRETTIFY_DURATION:
+        if ( ! _nk_format_string_load_format(context, parent, duration_format, FALSE, &modifiers.prettify.duration_format) )
+            goto fail;
+        _nk_format_string_compile(modifiers.prettify.duration_format);
+    break;
+    default:
+        goto error;
+    }
+
+    if ( ! _nk_format_string_load_format(context, parent, fallback, TRUE, &modifiers.fallback) )
+        goto fail;
+    if ( ! _nk_format_string_load_format(context, parent, substitute, TRUE, &modifiers.substitute) )
+        goto fail;
+
+    gsize c = g_variant_iter_n_children(replace);
+    if ( c > 0 )
+    {
+        const gchar *pattern;
+        guint32 flags;
+        gint32 replacement;
+
+        modifiers.replace = _nk_format_string_alloc(self, NkFormatStringRegex, c + 1);
+        c = 0;
+        while ( g_variant_iter_next(replace, "(&sui)", &pattern, &flags, &replacement) )
+        {
+            /* Compiled on first use */
+            modifiers.replace[c].pattern = pattern;
+            modifiers.replace[c].flags = flags;
+            if ( _nk_format_string_regex_is_literal(pattern, flags) )
+                modifiers.replace[c].length = strlen(pattern);
+            if ( ! _nk_format_string_load_format(context, parent, replacement, FALSE, &modifiers.replace[c].replacement) )
+                goto fail;
+            ++c;
+        }
+    }
+
+    ret = TRUE;
+    goto fail;
+
+error:
+    g_set_error(context->error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_BLOB, "Invalid token");
+fail:
+    /* Attached even on failure, so that the sub-formats get freed */
+    if ( ( modifiers.range.length > 0 ) || ( modifiers.switch_.true_ != NULL ) || modifiers.slice.sliced || ( modifiers.prettify.type != NK_FORMAT_STRING_PRETTIFY_NONE ) || ( modifiers.prettify.duration_format != NULL ) || ( modifiers.fallback != NULL ) || ( modifiers.substitute != NULL ) || ( modifiers.replace != NULL ) )
+    {
+        token->modifiers = _nk_format_string_alloc(self, NkFormatStringTokenModifiers, 1);
+        *token->modifiers = modifiers;
+    }
+    g_variant_iter_free(replace);
+    return ret;
+}
+
+static gboolean
+_nk_format_string_load_format(NkFormatStringLoadContext *context, gint32 parent, gint32 index, gboolean optional, NkFormatString **ret)
+{
+    if ( ( index < 0 ) && optional )
+        return TRUE;
+
+    /* Sub-formats come after their parent, and are used only once */
+    if ( ( index <= parent ) || ( (gsize) index >= context->size ) || context->loaded[index] )
+    {
+        g_set_error(context->error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_BLOB, "Invalid format index %d", index);
+        return FALSE;
+    }
+    context->loaded[index] = TRUE;
+
+    NkFormatString *self;
+    GVariant *format, *tokens;
+    guint64 length;
+
+    format = g_variant_get_child_value(context->formats, index);
+    g_variant_get(format, "(t@a" NK_FORMAT_STRING_BLOB_TOKEN_TYPE ")", &length, &tokens);
+    g_variant_unref(format);
+
+    gsize size = g_variant_n_children(tokens);
+    self = _nk_format_string_new(context->root, _nk_format_string_arena_hint(size));
+    if ( context->root == NULL )
+        context->root = self;
+    self->length = length;
+    self->tokens = _nk_format_string_alloc(self, NkFormatStringToken, size);
+    *ret = self;
+
+    gsize i;
+    for ( i = 0 ; i < size ; ++i )
+    {
+        GVariant *token = g_variant_get_child_value(tokens, i);
+        gboolean r = _nk_format_string_load_token(context, self, index, token, &self->tokens[self->size++]);
+        g_variant_unref(token);
+        if ( ! r )
+        {
+            g_variant_unref(tokens);
+            return FALSE;
+        }
+    }
+    g_variant_unref(tokens);
+
+    return TRUE;
+}
+
+/**
+ * nk_format_string_load:
+ * @bytes: a #GBytes from nk_format_string_save()
+ * @error: return location for a #GError, or %NULL
+ *
+ * Loads back a format string serialized with nk_format_string_save(),
+ * without parsing it again.
+ * @bytes may come from a file mapped with g_mapped_file_get_bytes(),
+ * strings are used in place and regexes are compiled on first use.
+ *
+ * Returns: (transfer full): an #NkFormatString, %NULL on error
+ */
+NK_EXPORT NkFormatString *
+nk_format_string_load(GBytes *bytes, GError **error)
+{
+    g_return_val_if_fail(bytes != NULL, NULL);
+    g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+    NkFormatString *self = NULL;
+    GVariant *blob;
+    const gchar *magic;
+    guint32 version;
+
+    blob = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(NK_FORMAT_STRING_BLOB_TYPE), bytes, FALSE));
+
+    /* We use strings in place, so we need them all to be valid */
+    if ( ! g_variant_is_normal_form(blob) )
+    {
+        g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_BLOB, "Invalid data");
+        goto fail;
+    }
+
+    NkFormatStringLoadContext context = {
+        .error = error,
+    };
+    g_variant_get(blob, "(&su@a(ta" NK_FORMAT_STRING_BLOB_TOKEN_TYPE "))", &magic, &version, &context.formats);
+    if ( ( g_strcmp0(magic, NK_FORMAT_STRING_BLOB_MAGIC) != 0 ) || ( version != NK_FORMAT_STRING_BLOB_VERSION ) )
+    {
+        g_variant_unref(context.formats);
+        g_set_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_BLOB, "Wrong data version");
+        goto fail;
+    }
+
+    context.size = g_variant_n_children(context.formats);
+    context.loaded = g_new0(gboolean, context.size);
+    gboolean r = _nk_format_string_load_format(&context, -1, 0, FALSE, &self);
+    g_free(context.loaded);
+    g_variant_unref(context.formats);
+
+    if ( ! r )
+    {
+        if ( self != NULL )
+            nk_format_string_unref(self);
+        self = NULL;
+        goto fail;
+    }
+
+    _nk_format_string_compile(self);
+    self->blob = blob;
+
+    return self;
+
+fail:
+    g_variant_unref(blob);
+    return NULL;
 }
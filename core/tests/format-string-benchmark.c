@@ -0,0 +1,537 @@
+/*
+ * libnkutils/format-string - Miscellaneous utilities, format string module benchmark
+ *
+ * Copyright © 2011-2024 Morgane "Sardem FF7" Glidic
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include <nkutils-format-string.h>
+#include "../src/format-string-internal.h"
+
+/*
+ * Each benchmark prints a JSON object on its own line:
+ * { "name": "replace/range", "iterations": 100000, "ns-per-op": 123.4, "allocations-per-op": 2.0 }
+ * Allocations are counted with glibc only, by interposing malloc(), calloc()
+ * and realloc(), which is what GLib uses; aligned allocations
+ * (posix_memalign(), aligned_alloc(), memalign()) are not counted.
+ * Sanitizers interpose these too, so they are null there, as elsewhere.
+ */
+
+#define DEFAULT_ITERATIONS 100000
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define NK_BENCHMARK_SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define NK_BENCHMARK_SANITIZED 1
+#endif
+#endif
+
+#if defined(__GLIBC__) && ! defined(NK_BENCHMARK_SANITIZED)
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 _nk_format_string_benchmark_allocations = 0;
+
+void *
+malloc(size_t size)
+{
+    ++_nk_format_string_benchmark_allocations;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    ++_nk_format_string_benchmark_allocations;
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    ++_nk_format_string_benchmark_allocations;
+    return __libc_realloc(ptr, size);
+}
+#endif /* __GLIBC__ && ! NK_BENCHMARK_SANITIZED */
+
+typedef enum {
+    BENCHMARK_PARSE,
+    BENCHMARK_PARSE_ENUM,
+    BENCHMARK_REPLACE,
+} NkFormatStringBenchmarkType;
+
+typedef struct {
+    const gchar *name;
+    const gchar *source;
+} NkFormatStringBenchmarkData;
+
+static const NkFormatStringBenchmarkData _nk_format_string_benchmarks[] = {
+    {
+        .name = "literal",
+        .source = "A long literal-heavy template, as found in status bars and notifications, with a single ${fruit} reference in the middle of a lot of text that is only copied.",
+    },
+    {
+        .name = "references",
+        .source = "${fruit} ${number} ${ratio} ${time} ${duration} ${bool} ${fruit} ${number} ${ratio} ${time} ${duration} ${bool}",
+    },
+    {
+        .name = "fallback",
+        .source = "${none:-${none:-${none:-${fruit}}}} ${fruit:+${none:-${number}}} ${none:!no data}",
+    },
+    {
+        .name = "range",
+        .source = "${number:[;0;2048;low;medium;high]} ${ratio:[;0;1;▁;▂;▃;▄;▅;▆;▇;█]}",
+    },
+    {
+        .name = "switch",
+        .source = "${bool:{;yes;no}} ${number:{;non-zero;zero}}",
+    },
+    {
+        .name = "keys",
+        .source = "${recipe[cream]} ${recipe[cake]} ${recipe[pie]:-no pie} ${list[1]} ${list[-1]} ${list[@/]}",
+    },
+    {
+        .name = "prettify/float",
+        .source = "${ratio(f)} ${ratio(f.2)} ${number(f08.3)}",
+    },
+    {
+        .name = "prettify/prefixes/si",
+        .source = "${number(p)} ${ratio(p.1)}",
+    },
+    {
+        .name = "prettify/prefixes/binary",
+        .source = "${number(b)} ${number(b.1)}",
+    },
+    {
+        .name = "prettify/time",
+        .source = "${time(t)} ${time(t%H:%M)}",
+    },
+    {
+        .name = "prettify/duration",
+        .source = "${duration(d)} ${duration(d%{days}d %{hours(f02)}:%{minutes(f02)}:%{seconds(f02)})}",
+    },
+    {
+        .name = "prettify/json",
+        .source = "{\"text\": \"${json(j)}\"}",
+    },
+    {
+        .name = "regex/literal",
+        .source = "${fruit/a/o} ${fruit/b/B/n/N}",
+    },
+    {
+        .name = "regex/pattern",
+        .source = "${fruit/[an]+/-} ${fruit/(.+)/(\\1)}",
+    },
+    {
+        .name = "regex/reference",
+        .source = "${fruit/na/${list[0]}}",
+    },
+};
+
+static const gchar * const _nk_format_string_benchmark_tokens[] = {
+    "fruit",
+    "number",
+    "ratio",
+    "time",
+    "duration",
+    "bool",
+    "json",
+    "recipe",
+    "list",
+    "none",
+};
+
+static const gchar * const _nk_format_string_benchmark_contents[G_N_ELEMENTS(_nk_format_string_benchmark_tokens)] = {
+    "'a banana'",
+    "1536",
+    "0.42",
+    "int64 1519910048",
+    "788645",
+    "true",
+    "'Some \"quoted\" text\\nwith a newline'",
+    "{'cream': <'banana split'>, 'cake': <'banana cake'>, 'count': <3>}",
+    "['apple', 'banana', 'pear']",
+    NULL,
+};
+
+static GVariant *_nk_format_string_benchmark_values[G_N_ELEMENTS(_nk_format_string_benchmark_tokens)];
+
+static GVariant *
+_nk_format_string_benchmark_callback(const gchar *name, guint64 value, gpointer user_data)
+{
+    gsize i;
+    for ( i = 0 ; i < G_N_ELEMENTS(_nk_format_string_benchmark_tokens) ; ++i )
+    {
+        if ( g_strcmp0(name, _nk_format_string_benchmark_tokens[i]) == 0 )
+            return ( _nk_format_string_benchmark_values[i] != NULL ) ? g_variant_ref(_nk_format_string_benchmark_values[i]) : NULL;
+    }
+    return NULL;
+}
+
+static GVariant *
+_nk_format_string_benchmark_enum_callback(const gchar *name, guint64 value, gpointer user_data)
+{
+    return ( _nk_format_string_benchmark_values[value] != NULL ) ? g_variant_ref(_nk_format_string_benchmark_values[value]) : NULL;
+}
+
+typedef struct {
+    gint64 start;
+    guint64 allocations;
+} NkFormatStringBenchmarkClock;
+
+static void
+_nk_format_string_benchmark_start(NkFormatStringBenchmarkClock *clock)
+{
+#ifdef COUNT_ALLOCATIONS
+    clock->allocations = _nk_format_string_benchmark_allocations;
+#endif /* COUNT_ALLOCATIONS */
+    clock->start = g_get_monotonic_time();
+}
+
+static void
+_nk_format_string_benchmark_report(const NkFormatStringBenchmarkClock *clock, const gchar *kind, const gchar *name, guint64 iterations)
+{
+    gint64 elapsed = g_get_monotonic_time() - clock->start;
+    gchar ns[G_ASCII_DTOSTR_BUF_SIZE];
+    gchar allocations[G_ASCII_DTOSTR_BUF_SIZE] = "null";
+
+    g_ascii_formatd(ns, sizeof(ns), "%.1f", (gdouble) elapsed * 1000. / iterations);
+#ifdef COUNT_ALLOCATIONS
+    g_ascii_formatd(allocations, sizeof(allocations), "%.2f", (gdouble) ( _nk_format_string_benchmark_allocations - clock->allocations ) / iterations);
+#endif /* COUNT_ALLOCATIONS */
+
+    g_print("{ \"name\": \"%s/%s\", \"iterations\": %" G_GUINT64_FORMAT ", \"ns-per-op\": %s, \"allocations-per-op\": %s }\n", kind, name, iterations, ns, allocations);
+}
+
+static void
+_nk_format_string_benchmark_run(const NkFormatStringBenchmarkData *data, NkFormatStringBenchmarkType type, guint64 iterations)
+{
+    NkFormatStringBenchmarkClock clock;
+    NkFormatString *format_string;
+    GError *error = NULL;
+    guint64 i;
+
+    switch ( type )
+    {
+    case BENCHMARK_PARSE:
+    {
+        gchar **strings = g_new(gchar *, iterations);
+        for ( i = 0 ; i < iterations ; ++i )
+            strings[i] = g_strdup(data->source);
+
+        _nk_format_string_benchmark_start(&clock);
+        for ( i = 0 ; i < iterations ; ++i )
+        {
+            format_string = nk_format_string_parse(strings[i], '$', &error);
+            g_assert_no_error(error);
+            nk_format_string_unref(format_string);
+        }
+        _nk_format_string_benchmark_report(&clock, "parse", data->name, iterations);
+
+        g_free(strings);
+    }
+    break;
+    case BENCHMARK_PARSE_ENUM:
+    {
+        gchar **strings = g_new(gchar *, iterations);
+        for ( i = 0 ; i < iterations ; ++i )
+            strings[i] = g_strdup(data->source);
+
+        _nk_format_string_benchmark_start(&clock);
+        for ( i = 0 ; i < iterations ; ++i )
+        {
+            format_string = nk_format_string_parse_enum(strings[i], '$', _nk_format_string_benchmark_tokens, G_N_ELEMENTS(_nk_format_string_benchmark_tokens), NULL, &error);
+            g_assert_no_error(error);
+            nk_format_string_unref(format_string);
+        }
+        _nk_format_string_benchmark_report(&clock, "parse-enum", data->name, iterations);
+
+        g_free(strings);
+    }
+    break;
+    case BENCHMARK_REPLACE:
+    {
+        GString *string = g_string_sized_new(1024);
+
+        format_string = nk_format_string_parse(g_strdup(data->source), '$', &error);
+        g_assert_no_error(error);
+
+        _nk_format_string_benchmark_start(&clock);
+        for ( i = 0 ; i < iterations ; ++i )
+        {
+            g_string_truncate(string, 0);
+            nk_format_string_replace_into(format_string, string, _nk_format_string_benchmark_callback, NULL);
+        }
+        _nk_format_string_benchmark_report(&clock, "replace", data->name, iterations);
+        nk_format_string_unref(format_string);
+
+        format_string = nk_format_string_parse_enum(g_strdup(data->source), '$', _nk_format_string_benchmark_tokens, G_N_ELEMENTS(_nk_format_string_benchmark_tokens), NULL, &error);
+        g_assert_no_error(error);
+
+        _nk_format_string_benchmark_start(&clock);
+        for ( i = 0 ; i < iterations ; ++i )
+        {
+            g_string_truncate(string, 0);
+            nk_format_string_replace_into(format_string, string, _nk_format_string_benchmark_enum_callback, NULL);
+        }
+        _nk_format_string_benchmark_report(&clock, "replace-enum", data->name, iterations);
+        nk_format_string_unref(format_string);
+
+        g_string_free(string, TRUE);
+    }
+    break;
+    }
+}
+
+static void
+_nk_format_string_benchmark_numbers_callback(const gchar *name, guint64 value, NkFormatStringValue *data, gpointer user_data)
+{
+    guint64 i = *(guint64 *) user_data;
+    switch ( name[0] )
+    {
+    case 'i':
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_INT64;
+        data->data.int64 = - (gint64) ( i * 7919 );
+    break;
+    case 'u':
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_UINT64;
+        data->data.uint64 = i * 104729;
+    break;
+    default:
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_DOUBLE;
+        data->data.double_ = i * 1.37;
+    break;
+    }
+}
+
+static void
+_nk_format_string_benchmark_numbers(guint64 iterations)
+{
+    NkFormatStringBenchmarkClock clock;
+    NkFormatString *format_string;
+    GString *string = g_string_sized_new(256);
+    GString *check = g_string_sized_new(256);
+    GError *error = NULL;
+    guint64 i;
+
+    format_string = nk_format_string_parse(g_strdup("${i} ${u} ${d} ${f(f.2)} ${s(p.1)} ${b(b.1)} ${w(f08.3)}"), '$', &error);
+    g_assert_no_error(error);
+
+    _nk_format_string_benchmark_start(&clock);
+    for ( i = 0 ; i < iterations ; ++i )
+    {
+        g_string_truncate(string, 0);
+        nk_format_string_replace_values_into(format_string, string, _nk_format_string_benchmark_numbers_callback, &i);
+    }
+    _nk_format_string_benchmark_report(&clock, "numbers", "replace", iterations);
+
+    /*
+     * The kernels alone, against printf with the same values and formats,
+     * as the library did before them, checking the last outputs match
+     */
+#define _nk_format_string_benchmark_kernel(name, kernel, ...) \
+    G_STMT_START { \
+        _nk_format_string_benchmark_start(&clock); \
+        for ( i = 0 ; i < iterations ; ++i ) \
+        { \
+            g_string_truncate(string, 0); \
+            kernel; \
+        } \
+        _nk_format_string_benchmark_report(&clock, "numbers", name "/format-string", iterations); \
+        g_string_assign(check, string->str); \
+        _nk_format_string_benchmark_start(&clock); \
+        for ( i = 0 ; i < iterations ; ++i ) \
+        { \
+            g_string_truncate(string, 0); \
+            g_string_append_printf(string, __VA_ARGS__); \
+        } \
+        _nk_format_string_benchmark_report(&clock, "numbers", name "/printf", iterations); \
+        g_assert_cmpstr(check->str, ==, string->str); \
+    } G_STMT_END
+
+    _nk_format_string_benchmark_kernel("int64",
+        nk_format_string_append_int64(string, - (gint64) ( i * 7919 )),
+        "%" G_GINT64_FORMAT, - (gint64) ( i * 7919 ));
+    _nk_format_string_benchmark_kernel("uint64",
+        nk_format_string_append_uint64(string, i * 104729),
+        "%" G_GUINT64_FORMAT, i * 104729);
+    _nk_format_string_benchmark_kernel("double",
+        nk_format_string_append_double(string, i * 1.37, 0, 6, FALSE),
+        "%*.*lf", 0, 6, i * 1.37);
+    _nk_format_string_benchmark_kernel("double/padded",
+        nk_format_string_append_double(string, i * 1.37, 8, 3, TRUE),
+        "%0*.*lf", 8, 3, i * 1.37);
+
+#undef _nk_format_string_benchmark_kernel
+
+    nk_format_string_unref(format_string);
+    g_string_free(check, TRUE);
+    g_string_free(string, TRUE);
+}
+
+static const gchar * const _nk_format_string_benchmark_variant_tokens[] = {
+    "n", "q", "i", "u", "x", "t", "y", "d", "b", "s", "nested",
+};
+
+static const gchar * const _nk_format_string_benchmark_variant_contents[G_N_ELEMENTS(_nk_format_string_benchmark_variant_tokens)] = {
+    "int16 -1234",
+    "uint16 1234",
+    "-123456",
+    "uint32 123456",
+    "int64 -1234567890",
+    "uint64 1234567890",
+    "byte 0x42",
+    "1.5",
+    "false",
+    "'banana'",
+    "[[int16 1, 2, 3], [4, 5], [6], [7, 8, 9, 10]]",
+};
+
+static GVariant *_nk_format_string_benchmark_variant_values[G_N_ELEMENTS(_nk_format_string_benchmark_variant_tokens)];
+
+static GVariant *
+_nk_format_string_benchmark_variants_callback(const gchar *name, guint64 value, gpointer user_data)
+{
+    return g_variant_ref(_nk_format_string_benchmark_variant_values[value]);
+}
+
+/* One pass of the type probing as done before classification, to compare with */
+static gint
+_nk_format_string_benchmark_variants_probe(GVariant *variant)
+{
+    if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_ARRAY) )
+        return 'a';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_STRING) )
+        return 's';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_BOOLEAN) )
+        return 'b';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_INT16) )
+        return 'n';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_INT32) )
+        return 'i';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_INT64) )
+        return 'x';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_BYTE) )
+        return 'y';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_UINT16) )
+        return 'q';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_UINT32) )
+        return 'u';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_UINT64) )
+        return 't';
+    else if ( g_variant_is_of_type(variant, G_VARIANT_TYPE_DOUBLE) )
+        return 'd';
+    return 0;
+}
+
+static void
+_nk_format_string_benchmark_variants(guint64 iterations)
+{
+    NkFormatStringBenchmarkClock clock;
+    NkFormatString *format_string;
+    GString *string = g_string_sized_new(1024);
+    GError *error = NULL;
+    guint64 i, sum = 0;
+    gsize j, n = G_N_ELEMENTS(_nk_format_string_benchmark_variant_values);
+
+    for ( j = 0 ; j < n ; ++j )
+        _nk_format_string_benchmark_variant_values[j] = g_variant_ref_sink(g_variant_parse(NULL, _nk_format_string_benchmark_variant_contents[j], NULL, NULL, NULL));
+
+    /* Reported per value, the nested array counting as its 10 numbers */
+    n -= 1;
+    format_string = nk_format_string_parse_enum(g_strdup("${n} ${q} ${i} ${u} ${x} ${t} ${y} ${d} ${b} ${s} ${nested[@ ]}"), '$', _nk_format_string_benchmark_variant_tokens, G_N_ELEMENTS(_nk_format_string_benchmark_variant_tokens), NULL, &error);
+    g_assert_no_error(error);
+
+    _nk_format_string_benchmark_start(&clock);
+    for ( i = 0 ; i < iterations ; ++i )
+    {
+        g_string_truncate(string, 0);
+        nk_format_string_replace_into(format_string, string, _nk_format_string_benchmark_variants_callback, NULL);
+    }
+    _nk_format_string_benchmark_report(&clock, "variants", "replace", iterations * ( n + 10 ));
+
+    _nk_format_string_benchmark_start(&clock);
+    for ( i = 0 ; i < iterations ; ++i )
+    {
+        for ( j = 0 ; j < n ; ++j )
+            sum += _nk_format_string_benchmark_variants_probe(_nk_format_string_benchmark_variant_values[j]);
+    }
+    _nk_format_string_benchmark_report(&clock, "variants", "is-of-type", iterations * n);
+
+    _nk_format_string_benchmark_start(&clock);
+    for ( i = 0 ; i < iterations ; ++i )
+    {
+        for ( j = 0 ; j < n ; ++j )
+            sum += g_variant_classify(_nk_format_string_benchmark_variant_values[j]);
+    }
+    _nk_format_string_benchmark_report(&clock, "variants", "classify", iterations * n);
+    g_assert_cmpuint(sum, >, 0);
+
+    nk_format_string_unref(format_string);
+    for ( j = 0 ; j < G_N_ELEMENTS(_nk_format_string_benchmark_variant_values) ; ++j )
+        g_variant_unref(_nk_format_string_benchmark_variant_values[j]);
+    g_string_free(string, TRUE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    guint64 iterations = DEFAULT_ITERATIONS;
+    gsize i;
+
+    if ( argc > 1 )
+        iterations = MAX(1, g_ascii_strtoull(argv[1], NULL, 10));
+
+    for ( i = 0 ; i < G_N_ELEMENTS(_nk_format_string_benchmark_tokens) ; ++i )
+    {
+        if ( _nk_format_string_benchmark_contents[i] != NULL )
+            _nk_format_string_benchmark_values[i] = g_variant_ref_sink(g_variant_parse(NULL, _nk_format_string_benchmark_contents[i], NULL, NULL, NULL));
+    }
+
+    for ( i = 0 ; i < G_N_ELEMENTS(_nk_format_string_benchmarks) ; ++i )
+    {
+        _nk_format_string_benchmark_run(&_nk_format_string_benchmarks[i], BENCHMARK_PARSE, MAX(1, iterations / 10));
+        _nk_format_string_benchmark_run(&_nk_format_string_benchmarks[i], BENCHMARK_PARSE_ENUM, MAX(1, iterations / 10));
+        _nk_format_string_benchmark_run(&_nk_format_string_benchmarks[i], BENCHMARK_REPLACE, iterations);
+    }
+    _nk_format_string_benchmark_numbers(iterations);
+    _nk_format_string_benchmark_variants(iterations);
+
+    for ( i = 0 ; i < G_N_ELEMENTS(_nk_format_string_benchmark_tokens) ; ++i )
+    {
+        if ( _nk_format_string_benchmark_values[i] != NULL )
+            g_variant_unref(_nk_format_string_benchmark_values[i]);
+    }
+
+    return 0;
+}
@@ -31,6 +31,9 @@
 #include <locale.h>
 
 #include <glib.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif /* G_OS_UNIX */
 
 #include "nkutils-format-string.h"
 
@@ -194,6 +197,18 @@ static const struct {
             .result = "You can make a banana cake with a banana."
         }
     },
+    {
+        .testpath = "/nkutils/format-string/key/name/several",
+        .data = {
+            .identifier = '$',
+            .source = "${recipe[cream]}, ${recipe[cake]}, ${recipe[count]} times, ${recipe[pie]:-no pie}, ${recipe[cream]}",
+            .data = {
+                { .name = "recipe", .content = "{'cream': <'banana split'>, 'cake': <<'banana cake'>>, 'count': <3>}" },
+                { .name = NULL }
+            },
+            .result = "banana split, banana cake, 3 times, no pie, banana split"
+        }
+    },
     {
         .testpath = "/nkutils/format-string/key/join/default",
         .data = {
@@ -233,6 +248,143 @@ static const struct {
             .result = "You can make [banana pie], [banana split] with a banana."
         }
     },
+    {
+        .testpath = "/nkutils/format-string/key/join/numbers",
+        .data = {
+            .identifier = '$',
+            .source = "${ints[@]} ${uints[@ ]} ${bytes[@-]}",
+            .data = {
+                { .name = "ints", .content = "[-1, 20, 300]" },
+                { .name = "uints", .content = "[uint64 18446744073709551615, 0]" },
+                { .name = "bytes", .content = "[byte 1, 255]" },
+                { .name = NULL }
+            },
+            .result = "-1, 20, 300 18446744073709551615 0 1-255"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/join/doubles",
+        .data = {
+            .identifier = '$',
+            .source = "${doubles[@; ]}",
+            .data = {
+                { .name = "doubles", .content = "[1.5, -0.25]" },
+                { .name = NULL }
+            },
+            .result = "1.500000; -0.250000"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/join/booleans",
+        .data = {
+            .identifier = '$',
+            .source = "${bools[@]}",
+            .data = {
+                { .name = "bools", .content = "[true, false]" },
+                { .name = NULL }
+            },
+            .result = "true, false"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/join/nested",
+        .data = {
+            .identifier = '$',
+            .source = "${nested[@|]}",
+            .data = {
+                { .name = "nested", .content = "[['a', 'b'], [], ['c']]" },
+                { .name = NULL }
+            },
+            .result = "a|b||c"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/join/nested-numbers",
+        .data = {
+            .identifier = '$',
+            .source = "${nested[@ ]}",
+            .data = {
+                { .name = "nested", .content = "[[int16 -1, 2], [], [3]]" },
+                { .name = NULL }
+            },
+            .result = "-1 2  3"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/types/integers",
+        .data = {
+            .identifier = '$',
+            .source = "${n} ${q} ${y} ${t}",
+            .data = {
+                { .name = "n", .content = "int16 -2" },
+                { .name = "q", .content = "uint16 3" },
+                { .name = "y", .content = "byte 4" },
+                { .name = "t", .content = "uint64 6" },
+                { .name = NULL }
+            },
+            .result = "-2 3 4 6"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/slice/window",
+        .data = {
+            .identifier = '$',
+            .source = "${recipes[@, ;1:3]}",
+            .data = {
+                { .name = "recipes", .content = "['banana pie', 'banana split', 'banana cake', 'banana bread']" },
+                { .name = NULL }
+            },
+            .result = "banana split, banana cake"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/slice/default-joiner",
+        .data = {
+            .identifier = '$',
+            .source = "${numbers[@;:2]}",
+            .data = {
+                { .name = "numbers", .content = "[1, 2, 3]" },
+                { .name = NULL }
+            },
+            .result = "1, 2"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/slice/negative",
+        .data = {
+            .identifier = '$',
+            .source = "${numbers[@ ;-2:]} ${numbers[@ ;:-1]}",
+            .data = {
+                { .name = "numbers", .content = "[1, 2, 3]" },
+                { .name = NULL }
+            },
+            .result = "2 3 1 2"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/slice/out-of-range",
+        .data = {
+            .identifier = '$',
+            .source = "[${numbers[@ ;5:10]}] ${numbers[@ ;-10:10]}",
+            .data = {
+                { .name = "numbers", .content = "[1, 2, 3]" },
+                { .name = NULL }
+            },
+            .result = "[] 1 2 3"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/key/slice/not-a-slice",
+        .data = {
+            .identifier = '$',
+            .source = "${recipes[@;x]}",
+            .data = {
+                { .name = "recipes", .content = "['banana pie', 'banana split']" },
+                { .name = NULL }
+            },
+            .result = "banana pie;xbanana split"
+        }
+    },
     {
         .testpath = "/nkutils/format-string/wrong/modifier",
         .data = {
@@ -337,6 +489,18 @@ static const struct {
             .result = "I want to eat a zucchini."
         }
     },
+    {
+        .testpath = "/nkutils/format-string/fallback/nested",
+        .data = {
+            .identifier = '$',
+            .source = "I want to eat ${fruit:-${vegetable:+some ${vegetable:!nothing}${adjective:-green} ${vegetable}}}.",
+            .data = {
+                { .name = "vegetable", .content = "'zucchinis'" },
+                { .name = NULL }
+            },
+            .result = "I want to eat some green zucchinis."
+        }
+    },
     {
         .testpath = "/nkutils/format-string/substitute/with",
         .data = {
@@ -572,6 +736,54 @@ static const struct {
             .result = "1.00000"
         }
     },
+    {
+        .testpath = "/nkutils/format-string/prettify/float/negative-0-padding",
+        .data = {
+            .identifier = '$',
+            .source = "${value(f06.2)}",
+            .data = {
+                { .name = "value", .content = "-3.14159" },
+                { .name = NULL }
+            },
+            .result = "-03.14"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/prettify/float/default-precision",
+        .data = {
+            .identifier = '$',
+            .source = "${value(f)}",
+            .data = {
+                { .name = "value", .content = "2.5" },
+                { .name = NULL }
+            },
+            .result = "2.500000"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/prettify/float/tie",
+        .data = {
+            .identifier = '$',
+            .source = "${value(f.1)}",
+            .data = {
+                { .name = "value", .content = "0.25" },
+                { .name = NULL }
+            },
+            .result = "0.2"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/prettify/float/inexact-tie",
+        .data = {
+            .identifier = '$',
+            .source = "${value(f.2)}",
+            .data = {
+                { .name = "value", .content = "2.675" },
+                { .name = NULL }
+            },
+            .result = "2.67"
+        }
+    },
     {
         .testpath = "/nkutils/format-string/prettify/prefixes/si/big",
         .data = {
@@ -768,6 +980,30 @@ static const struct {
             .result = "\"some maybe-escaped\\\\ntext\""
         }
     },
+    {
+        .testpath = "/nkutils/format-string/prettify/json/control",
+        .data = {
+            .identifier = '$',
+            .source = "\"${text(j)}\"",
+            .data = {
+                { .name = "text", .content = "'some\\ttext\\rwith\\u0001control'" },
+                { .name = NULL }
+            },
+            .result = "\"some\\ttext\\rwith\\u0001control\""
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/prettify/json/long",
+        .data = {
+            .identifier = '$',
+            .source = "\"${text(j)}\"",
+            .data = {
+                { .name = "text", .content = "'some ünïcödé text, long enough to need \"several\" blocks'" },
+                { .name = NULL }
+            },
+            .result = "\"some ünïcödé text, long enough to need \\\"several\\\" blocks\""
+        }
+    },
     {
         .testpath = "/nkutils/format-string/replace/full",
         .data = {
@@ -984,6 +1220,78 @@ static const struct {
             .result = "I want to eat a blackberry pie."
         }
     },
+    {
+        .testpath = "/nkutils/format-string/replace/literal/reference",
+        .data = {
+            .identifier = '$',
+            .source = "${data/an/[\\0]}",
+            .data = {
+                { .name = "data", .content = "'banana'" },
+                { .name = NULL }
+            },
+            .result = "b[an][an]a"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/replace/chain/literal",
+        .data = {
+            .identifier = '$',
+            .source = "${data/a/1/b/2/c/3}",
+            .data = {
+                { .name = "data", .content = "'abcabc'" },
+                { .name = NULL }
+            },
+            .result = "123123"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/replace/chain/literal/number",
+        .data = {
+            .identifier = '$',
+            .source = "${data/1/one}",
+            .data = {
+                { .name = "data", .content = "10" },
+                { .name = NULL }
+            },
+            .result = "one0"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/replace/chain/dependent",
+        .data = {
+            .identifier = '$',
+            .source = "${data/a/b/b/c}",
+            .data = {
+                { .name = "data", .content = "'ab'" },
+                { .name = NULL }
+            },
+            .result = "cc"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/replace/chain/overlapping",
+        .data = {
+            .identifier = '$',
+            .source = "${data/ab/x/bc/y}",
+            .data = {
+                { .name = "data", .content = "'abc'" },
+                { .name = NULL }
+            },
+            .result = "xc"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/replace/chain/joining",
+        .data = {
+            .identifier = '$',
+            .source = "${data/-//ab/x}",
+            .data = {
+                { .name = "data", .content = "'a-b'" },
+                { .name = NULL }
+            },
+            .result = "x"
+        }
+    },
     {
         .testpath = "/nkutils/format-string/old/before-after",
         .data = {
@@ -1008,6 +1316,32 @@ static const struct {
             .result = "echo ${PATH}"
         }
     },
+    {
+        .testpath = "/nkutils/format-string/identifier/multiple-escapes",
+        .data = {
+            .identifier = '$',
+            .source = "$$a$$$${b} ${c} $$",
+            .data = {
+                { .name = "c", .content = "'x'" },
+                { .name = NULL }
+            },
+            .result = "$a$${b} x $"
+        }
+    },
+    {
+        .testpath = "/nkutils/format-string/fold/empty",
+        .data = {
+            .identifier = '$',
+            .source = "a${b:+}${c:!}${d:{;;}}${f:-}z",
+            .data = {
+                { .name = "b", .content = "'x'" },
+                { .name = "d", .content = "true" },
+                { .name = "f", .content = "false" },
+                { .name = NULL }
+            },
+            .result = "az"
+        }
+    },
     {
         .testpath = "/nkutils/format-string/identifier/non-dollar",
         .data = {
@@ -1068,6 +1402,18 @@ static const struct {
             .result = "{}"
         }
     },
+    {
+        .testpath = "/nkutils/format-string/bug/pairing/escaped-then-more",
+        .data = {
+            .identifier = '$',
+            .source = "${variable:+\\{\\}\\{} and a long enough literal between ${variable:+\\}}${variable}.",
+            .data = {
+                { .name = "variable", .content = "'v'" },
+                { .name = NULL }
+            },
+            .result = "{}{ and a long enough literal between }v."
+        }
+    },
     {
         .testpath = "/nkutils/format-string/bug/pairing/unescaped-pair",
         .data = {
@@ -1103,6 +1449,31 @@ _nk_format_string_tests_func(gconstpointer user_data)
     NkFormatString *format_string;
     GError *error = NULL;
 
+    /* Parse from a non-nul-terminated constant string first */
+    gchar *source = g_strconcat(data->source, "${garbage}", NULL);
+    format_string = nk_format_string_parse_const(source, strlen(data->source), data->identifier, &error);
+    if ( data->result == NULL )
+    {
+        g_assert_null(format_string);
+        g_assert_error(error, NK_FORMAT_STRING_ERROR, data->error);
+        g_clear_error(&error);
+    }
+    else
+    {
+        g_assert_nonnull(format_string);
+        g_assert_no_error(error);
+
+        gchar *result;
+        result = nk_format_string_replace(format_string, _nk_format_string_tests_callback, data);
+        g_assert_cmpstr(result, ==, data->result);
+        g_free(result);
+
+        nk_format_string_unref(format_string);
+    }
+    g_assert_true(g_str_has_prefix(source, data->source));
+    g_assert_cmpstr(source + strlen(data->source), ==, "${garbage}");
+    g_free(source);
+
     format_string = nk_format_string_parse(g_strdup(data->source), data->identifier, &error);
     if ( data->result == NULL )
     {
@@ -1119,6 +1490,30 @@ _nk_format_string_tests_func(gconstpointer user_data)
 
     g_assert_cmpstr(result, ==, data->result);
 
+    GString *string;
+    string = g_string_new(data->result);
+    nk_format_string_replace_into(format_string, string, _nk_format_string_tests_callback, data);
+    g_assert_cmpuint(string->len, ==, 2 * strlen(data->result));
+    g_assert_cmpstr(string->str + strlen(data->result), ==, data->result);
+
+    g_string_truncate(string, 0);
+    nk_format_string_replace_into(format_string, string, _nk_format_string_tests_callback, data);
+    g_assert_cmpstr(string->str, ==, data->result);
+    g_string_free(string, TRUE);
+
+    GBytes *bytes;
+    NkFormatString *loaded;
+    bytes = nk_format_string_save(format_string);
+    loaded = nk_format_string_load(bytes, &error);
+    g_bytes_unref(bytes);
+    g_assert_no_error(error);
+    g_assert_nonnull(loaded);
+    g_free(result);
+    result = nk_format_string_replace(loaded, _nk_format_string_tests_callback, data);
+    g_assert_cmpstr(result, ==, data->result);
+    g_free(result);
+    nk_format_string_unref(loaded);
+
     nk_format_string_unref(format_string);
     nk_format_string_unref(format_string);
 }
@@ -1313,16 +1708,700 @@ _nk_format_string_enum_tests_func(gconstpointer user_data)
 
     g_assert_cmpstr(result, ==, data->result);
 
+    GBytes *bytes;
+    NkFormatString *loaded;
+    bytes = nk_format_string_save(format_string);
+    loaded = nk_format_string_load(bytes, &error);
+    g_bytes_unref(bytes);
+    g_assert_no_error(error);
+    g_assert_nonnull(loaded);
+    g_free(result);
+    result = nk_format_string_replace(loaded, _nk_format_string_enum_tests_callback, data->data);
+    g_assert_cmpstr(result, ==, data->result);
+    g_free(result);
+    nk_format_string_unref(loaded);
+
     nk_format_string_unref(format_string);
 }
 
-int
-main(int argc, char *argv[])
+static void
+_nk_format_string_load_tests_func(void)
 {
-    setlocale(LC_ALL, "C");
+    NkFormatString *format_string;
+    GBytes *bytes;
+    GError *error = NULL;
 
-    g_setenv("LANG", "C", TRUE);
-    g_setenv("TZ", "UTC", TRUE);
+    bytes = g_bytes_new_static("garbage", strlen("garbage"));
+    format_string = nk_format_string_load(bytes, &error);
+    g_assert_null(format_string);
+    g_assert_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_WRONG_BLOB);
+    g_clear_error(&error);
+    g_bytes_unref(bytes);
+}
+
+static GVariant *
+_nk_format_string_cache_tests_callback(const gchar *name, G_GNUC_UNUSED guint64 value, gpointer user_data)
+{
+    guint *calls = user_data;
+    ++*calls;
+    if ( g_strcmp0(name, "none") == 0 )
+        return NULL;
+    return g_variant_new_string(name);
+}
+
+static void
+_nk_format_string_cache_tests_func(void)
+{
+    NkFormatString *format_string;
+    guint calls = 0;
+    GError *error = NULL;
+
+    format_string = nk_format_string_parse(g_strdup("${a} ${b:+${a}} ${a/a/${b}} ${none:-${none}none}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    gchar *result;
+    result = nk_format_string_replace(format_string, _nk_format_string_cache_tests_callback, &calls);
+    g_assert_cmpstr(result, ==, "a a b none");
+    g_assert_cmpuint(calls, ==, 3);
+    g_free(result);
+
+    nk_format_string_unref(format_string);
+}
+
+static void
+_nk_format_string_batch_tests_callback(const NkFormatStringReference *references, gsize size, GVariant **data, gpointer user_data)
+{
+    guint *calls = user_data;
+    gsize i;
+
+    ++*calls;
+    for ( i = 0 ; i < size ; ++i )
+    {
+        if ( g_strcmp0(references[i].name, "none") != 0 )
+            data[i] = g_variant_new_string(references[i].name);
+    }
+}
+
+static void
+_nk_format_string_batch_tests_func(void)
+{
+    NkFormatString *format_string;
+    guint calls = 0;
+    GError *error = NULL;
+
+    format_string = nk_format_string_parse(g_strdup("${a} ${b:+${a}} ${a/a/${c}} ${none:-${none}none}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    const NkFormatStringReference *references;
+    gsize size;
+    references = nk_format_string_get_references(format_string, &size);
+    g_assert_cmpuint(size, ==, 4);
+    g_assert_cmpstr(references[0].name, ==, "a");
+    g_assert_cmpstr(references[1].name, ==, "b");
+    g_assert_cmpstr(references[2].name, ==, "c");
+    g_assert_cmpstr(references[3].name, ==, "none");
+
+    gchar *result;
+    result = nk_format_string_replace_batch(format_string, _nk_format_string_batch_tests_callback, &calls);
+    g_assert_cmpstr(result, ==, "a a c none");
+    g_assert_cmpuint(calls, ==, 1);
+    g_free(result);
+
+    GString *string;
+    string = g_string_new("");
+    nk_format_string_replace_batch_into(format_string, string, _nk_format_string_batch_tests_callback, &calls);
+    g_assert_cmpstr(string->str, ==, "a a c none");
+    g_assert_cmpuint(calls, ==, 2);
+    g_string_free(string, TRUE);
+
+    nk_format_string_unref(format_string);
+}
+
+static void
+_nk_format_string_values_tests_callback(const gchar *name, G_GNUC_UNUSED guint64 value, NkFormatStringValue *data, gpointer user_data)
+{
+    guint *calls = user_data;
+    ++*calls;
+    if ( g_strcmp0(name, "int") == 0 )
+    {
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_INT64;
+        data->data.int64 = -42;
+    }
+    else if ( g_strcmp0(name, "uint") == 0 )
+    {
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_UINT64;
+        data->data.uint64 = 1000000;
+    }
+    else if ( g_strcmp0(name, "double") == 0 )
+    {
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_DOUBLE;
+        data->data.double_ = 24.5;
+    }
+    else if ( g_strcmp0(name, "true") == 0 )
+    {
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN;
+        data->data.boolean = TRUE;
+    }
+    else if ( g_strcmp0(name, "false") == 0 )
+    {
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_BOOLEAN;
+        data->data.boolean = FALSE;
+    }
+    else if ( g_strcmp0(name, "string") == 0 )
+    {
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_STRING;
+        data->data.string = "\"foo\"";
+    }
+    else if ( g_strcmp0(name, "variant") == 0 )
+    {
+        const gchar * const fruits[] = { "apple", "banana" };
+        data->type = NK_FORMAT_STRING_VALUE_TYPE_VARIANT;
+        data->data.variant = g_variant_new_strv(fruits, G_N_ELEMENTS(fruits));
+    }
+}
+
+static void
+_nk_format_string_values_tests_func(void)
+{
+    NkFormatString *format_string;
+    guint calls = 0;
+    GError *error = NULL;
+
+    format_string = nk_format_string_parse(g_strdup("${int} ${int(f.1)} ${uint(p)} ${double:[;0;100;low;medium;high;full]} ${true:{;yes;no}} ${false:-no} ${string(j)} ${string/o+/a} ${variant} ${variant[1]} ${none:-none} ${int:+${uint}}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    gchar *result;
+    result = nk_format_string_replace_values(format_string, _nk_format_string_values_tests_callback, &calls);
+    g_assert_cmpstr(result, ==, "-42 -42.0 1M low yes no \\\"foo\\\" \"fa\" apple, banana banana none 1000000");
+    g_assert_cmpuint(calls, ==, 8);
+    g_free(result);
+
+    GString *string;
+    string = g_string_new("");
+    nk_format_string_replace_values_into(format_string, string, _nk_format_string_values_tests_callback, &calls);
+    g_assert_cmpstr(string->str, ==, "-42 -42.0 1M low yes no \\\"foo\\\" \"fa\" apple, banana banana none 1000000");
+    g_assert_cmpuint(calls, ==, 16);
+    g_string_free(string, TRUE);
+
+    nk_format_string_unref(format_string);
+}
+
+typedef struct {
+    const gchar *values['e' - 'a' + 1];
+    guint calls;
+} NkFormatStringRenderStateTestData;
+
+static GVariant *
+_nk_format_string_render_state_tests_callback(const gchar *name, G_GNUC_UNUSED guint64 value, gpointer user_data)
+{
+    NkFormatStringRenderStateTestData *data = user_data;
+    const gchar *v = data->values[name[0] - 'a'];
+    ++data->calls;
+    if ( v == NULL )
+        return NULL;
+    return g_variant_new_string(v);
+}
+
+static void
+_nk_format_string_render_state_tests_func(void)
+{
+    NkFormatStringRenderStateTestData data = {
+        .values = { "1", NULL, "C", "xx", "E" },
+    };
+    NkFormatString *format_string;
+    NkFormatStringRenderState *state;
+    GError *error = NULL;
+
+    format_string = nk_format_string_parse(g_strdup("${a} [${b:-${c}}] ${d/x/${a}} ${e}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    state = nk_format_string_render_state_new(format_string);
+    nk_format_string_unref(format_string);
+
+    g_assert_cmpstr(nk_format_string_render_state_replace(state, _nk_format_string_render_state_tests_callback, &data), ==, "1 [C] 11 E");
+    g_assert_cmpuint(data.calls, ==, 5);
+
+    g_assert_cmpstr(nk_format_string_render_state_replace(state, _nk_format_string_render_state_tests_callback, &data), ==, "1 [C] 11 E");
+    g_assert_cmpuint(data.calls, ==, 5);
+
+    data.values['c' - 'a'] = "D";
+    nk_format_string_render_state_invalidate(state, "c");
+    g_assert_cmpstr(nk_format_string_render_state_replace(state, _nk_format_string_render_state_tests_callback, &data), ==, "1 [D] 11 E");
+    g_assert_cmpuint(data.calls, ==, 6);
+
+    nk_format_string_render_state_invalidate(state, "e");
+    g_assert_cmpstr(nk_format_string_render_state_replace(state, _nk_format_string_render_state_tests_callback, &data), ==, "1 [D] 11 E");
+    g_assert_cmpuint(data.calls, ==, 7);
+
+    data.values['a' - 'a'] = "2";
+    data.values['b' - 'a'] = "B";
+    nk_format_string_render_state_invalidate(state, "a");
+    g_assert_cmpstr(nk_format_string_render_state_replace(state, _nk_format_string_render_state_tests_callback, &data), ==, "2 [D] 22 E");
+    g_assert_cmpuint(data.calls, ==, 8);
+
+    nk_format_string_render_state_invalidate_all(state);
+    g_assert_cmpstr(nk_format_string_render_state_replace(state, _nk_format_string_render_state_tests_callback, &data), ==, "2 [B] 22 E");
+    g_assert_cmpuint(data.calls, ==, 13);
+
+    nk_format_string_render_state_free(state);
+}
+
+static void
+_nk_format_string_shared_tests_func(void)
+{
+    NkFormatString *a, *b, *c;
+    guint64 hits, misses, used_tokens = 0;
+    GError *error = NULL;
+
+    nk_format_string_cache_clear();
+    nk_format_string_cache_get_stats(&hits, &misses);
+
+    a = nk_format_string_parse_shared("${fruit} ${recipe}", '$', &error);
+    g_assert_no_error(error);
+    b = nk_format_string_parse_shared("${fruit} ${recipe}", '$', &error);
+    g_assert_no_error(error);
+    g_assert_true(a == b);
+    nk_format_string_unref(b);
+
+    b = nk_format_string_parse_shared("${fruit} ${recipe}", '%', &error);
+    g_assert_no_error(error);
+    g_assert_true(a != b);
+    nk_format_string_unref(b);
+
+    b = nk_format_string_parse_enum_shared("${fruit} ${recipe}", '$', _nk_format_string_enum_tests_tokens, _TOKEN_SIZE, &used_tokens, &error);
+    g_assert_no_error(error);
+    g_assert_true(a != b);
+    g_assert_cmpuint(used_tokens, ==, ( 1 << TOKEN_FRUIT ) | ( 1 << TOKEN_RECIPE ));
+    nk_format_string_unref(b);
+
+    used_tokens = 0;
+    b = nk_format_string_parse_enum_shared("${fruit} ${recipe}", '$', _nk_format_string_enum_tests_tokens, _TOKEN_SIZE, &used_tokens, &error);
+    g_assert_no_error(error);
+    g_assert_cmpuint(used_tokens, ==, ( 1 << TOKEN_FRUIT ) | ( 1 << TOKEN_RECIPE ));
+
+    c = nk_format_string_parse_shared("${fruit::}", '$', &error);
+    g_assert_null(c);
+    g_assert_error(error, NK_FORMAT_STRING_ERROR, NK_FORMAT_STRING_ERROR_UNKNOWN_MODIFIER);
+    g_clear_error(&error);
+
+    guint64 h, m;
+    nk_format_string_cache_get_stats(&h, &m);
+    g_assert_cmpuint(h - hits, ==, 2);
+    g_assert_cmpuint(m - misses, ==, 4);
+
+    /* a is the least recently used */
+    nk_format_string_cache_set_size(2);
+    c = nk_format_string_parse_enum_shared("${fruit} ${recipe}", '$', _nk_format_string_enum_tests_tokens, _TOKEN_SIZE, NULL, &error);
+    g_assert_true(b == c);
+    nk_format_string_unref(c);
+    c = nk_format_string_parse_shared("${fruit} ${recipe}", '$', &error);
+    g_assert_true(a != c);
+    nk_format_string_unref(c);
+
+    nk_format_string_cache_set_size(64);
+    nk_format_string_cache_clear();
+    nk_format_string_unref(b);
+    nk_format_string_unref(a);
+}
+
+static void
+_nk_format_string_replace_cache_tests_func(void)
+{
+    NkFormatStringRenderStateTestData data = {
+        .values = { "banana", "o" },
+    };
+    NkFormatString *format_string;
+    GError *error = NULL;
+
+    format_string = nk_format_string_parse(g_strdup("${a/a/${b}/n+/m}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    nk_format_string_replace_cache_set_size(1);
+
+    gchar *result;
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "bomomo");
+    g_free(result);
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "bomomo");
+    g_free(result);
+
+    /* Replacements are part of the key */
+    data.values['b' - 'a'] = "i";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "bimimi");
+    g_free(result);
+
+    data.values['a' - 'a'] = "ananas";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "imimis");
+    g_free(result);
+
+    /* Evicted */
+    data.values['a' - 'a'] = "banana";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "bimimi");
+    g_free(result);
+
+    nk_format_string_replace_cache_set_size(0);
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "bimimi");
+    g_free(result);
+
+    nk_format_string_replace_cache_set_size(8);
+    nk_format_string_unref(format_string);
+}
+
+static void
+_nk_format_string_time_cache_tests_func(void)
+{
+    NkFormatStringRenderStateTestData data = {
+        .values = { "1519910048", "1519910048" },
+    };
+    NkFormatString *format_string;
+    GError *error = NULL;
+
+    format_string = nk_format_string_parse(g_strdup("${a(t%H:%M)} ${b(t%F %T)}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    gchar *result;
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "13:14 2018-03-01 13:14:08");
+    g_free(result);
+
+    /* Same minute, next second */
+    data.values['a' - 'a'] = "1519910099";
+    data.values['b' - 'a'] = "1519910049";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "13:14 2018-03-01 13:14:09");
+    g_free(result);
+
+    /* Next minute, back in time */
+    data.values['a' - 'a'] = "1519910100";
+    data.values['b' - 'a'] = "1519910047";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "13:15 2018-03-01 13:14:07");
+    g_free(result);
+
+    /* Previous minute again */
+    data.values['a' - 'a'] = "1519910040";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "13:14 2018-03-01 13:14:07");
+    g_free(result);
+
+    nk_format_string_unref(format_string);
+
+    format_string = nk_format_string_parse(g_strdup("${a(t%F)}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    data.values['a' - 'a'] = "1519862400";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "2018-03-01");
+    g_free(result);
+
+    data.values['a' - 'a'] = "1519948799";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "2018-03-01");
+    g_free(result);
+
+    data.values['a' - 'a'] = "1519948800";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "2018-03-02");
+    g_free(result);
+
+    data.values['a' - 'a'] = "1519862399";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "2018-02-28");
+    g_free(result);
+
+    nk_format_string_unref(format_string);
+
+    /* The timezone is checked again when leaving the cached span */
+    format_string = nk_format_string_parse(g_strdup("${a(t%H:%M)}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    data.values['a' - 'a'] = "1519910048";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "13:14");
+    g_free(result);
+
+    g_setenv("TZ", "CET-1", TRUE);
+    data.values['a' - 'a'] = "1519910100";
+    result = nk_format_string_replace(format_string, _nk_format_string_render_state_tests_callback, &data);
+    g_assert_cmpstr(result, ==, "14:15");
+    g_free(result);
+    g_setenv("TZ", "UTC", TRUE);
+
+    nk_format_string_unref(format_string);
+}
+
+static gboolean
+_nk_format_string_write_tests_callback(const NkFormatStringOutputVector *vectors, gsize size, gpointer user_data, GError **error)
+{
+    GString *string = user_data;
+    gsize i;
+
+    g_string_append_printf(string, "%" G_GSIZE_FORMAT ":", size);
+    for ( i = 0 ; i < size ; ++i )
+        g_string_append_len(string, vectors[i].buffer, vectors[i].size);
+
+    return TRUE;
+}
+
+#define WRITE_TESTS_SOURCE "This is a long enough literal: ${a}, ${b:-short} and ${c:-another long enough fallback} ${d} to end."
+#define WRITE_TESTS_RESULT "This is a long enough literal: banana, short and another long enough fallback coconut to end."
+
+static void
+_nk_format_string_write_tests_func(void)
+{
+    NkFormatStringRenderStateTestData data = {
+        .values = { "banana", NULL, NULL, "coconut" },
+    };
+    NkFormatString *format_string;
+    GError *error = NULL;
+    GString *string;
+
+    format_string = nk_format_string_parse(g_strdup(WRITE_TESTS_SOURCE), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    string = g_string_new("");
+    g_assert_true(nk_format_string_replace_write(format_string, _nk_format_string_render_state_tests_callback, &data, _nk_format_string_write_tests_callback, string, &error));
+    g_assert_no_error(error);
+    /* Long literals come as their own vectors, the rest is buffered */
+    g_assert_cmpstr(string->str, ==, "4:" WRITE_TESTS_RESULT);
+    g_string_free(string, TRUE);
+
+#ifdef G_OS_UNIX
+    gint fds[2];
+    gchar buffer[sizeof(WRITE_TESTS_RESULT)];
+    gssize length;
+
+    g_assert_cmpint(pipe(fds), ==, 0);
+    g_assert_true(nk_format_string_replace_fd(format_string, fds[1], _nk_format_string_render_state_tests_callback, &data, &error));
+    g_assert_no_error(error);
+    close(fds[1]);
+    length = read(fds[0], buffer, sizeof(buffer));
+    g_assert_cmpint(length, ==, strlen(WRITE_TESTS_RESULT));
+    buffer[length] = '\0';
+    g_assert_cmpstr(buffer, ==, WRITE_TESTS_RESULT);
+
+    g_assert_false(nk_format_string_replace_fd(format_string, fds[1], _nk_format_string_render_state_tests_callback, &data, &error));
+    g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_BADF);
+    g_clear_error(&error);
+    close(fds[0]);
+#endif /* G_OS_UNIX */
+
+    nk_format_string_unref(format_string);
+}
+
+#define THREADS_COUNT 8
+#define THREADS_ITERATIONS 500
+
+static const NkFormatStringTestDataData _nk_format_string_threads_tests_data[] = {
+    { .name = "fruit", .content = "'a banana'" },
+    { .name = "dict", .content = "{ 'recipe': <'a banana split'> }" },
+    { .name = "list", .content = "[ 'apple', 'banana', 'pear' ]" },
+    { .name = "number", .content = "int64 1536" },
+    { .name = "bool", .content = "true" },
+    { .name = "time", .content = "int64 0" },
+    { .name = "duration", .content = "int64 90061" },
+    { .name = "json", .content = "'\"quoted\"\\n'" },
+    { .name = NULL }
+};
+
+static GVariant *
+_nk_format_string_threads_tests_callback(const gchar *name, G_GNUC_UNUSED guint64 value, gpointer user_data)
+{
+    const NkFormatStringTestDataData *data;
+    for ( data = user_data ; data->name != NULL ; ++data )
+    {
+        if ( g_strcmp0(name, data->name) == 0 )
+            return g_variant_parse(NULL, data->content, NULL, NULL, NULL);
+    }
+    return NULL;
+}
+
+typedef struct {
+    NkFormatString *format_string;
+    const gchar *result;
+} NkFormatStringThreadsTestData;
+
+static gpointer
+_nk_format_string_threads_tests_thread(gpointer user_data)
+{
+    NkFormatStringThreadsTestData *data = user_data;
+    GString *string;
+    gsize i;
+
+    string = g_string_new("");
+    for ( i = 0 ; i < THREADS_ITERATIONS ; ++i )
+    {
+        NkFormatString *format_string = nk_format_string_ref(data->format_string);
+
+        gchar *result;
+        result = nk_format_string_replace(format_string, _nk_format_string_threads_tests_callback, (gpointer) _nk_format_string_threads_tests_data);
+        g_assert_cmpstr(result, ==, data->result);
+        g_free(result);
+
+        g_string_truncate(string, 0);
+        nk_format_string_replace_into(format_string, string, _nk_format_string_threads_tests_callback, (gpointer) _nk_format_string_threads_tests_data);
+        g_assert_cmpstr(string->str, ==, data->result);
+
+        nk_format_string_unref(format_string);
+    }
+    g_string_free(string, TRUE);
+
+    return NULL;
+}
+
+static void
+_nk_format_string_threads_tests_func(void)
+{
+    NkFormatStringThreadsTestData data;
+    GThread *threads[THREADS_COUNT];
+    GError *error = NULL;
+    gsize i;
+
+    data.format_string = nk_format_string_parse(g_strdup("${fruit} ${dict[recipe]} ${list[1]} ${list[@/]} ${none:-fallback} ${fruit:+substitute} ${none:!no data} ${number:[;0;2048;low;medium;high]} ${bool:{;yes;no}} ${number(f.1)} ${number(p.1)} ${number(b.1)} ${time(t%Y)} ${duration(d)} ${json(j)} ${fruit/na/${list[2]}}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(data.format_string);
+
+    gchar *result;
+    result = nk_format_string_replace(data.format_string, _nk_format_string_threads_tests_callback, (gpointer) _nk_format_string_threads_tests_data);
+    g_assert_cmpstr(result, ==, "a banana a banana split banana apple/banana/pear fallback substitute no data high yes 1536.0 1.5k 1.5Ki 1970 1 day 1 hour 1 minute 1 second \\\"quoted\\\"\\n a bapearpear");
+    data.result = result;
+
+    for ( i = 0 ; i < THREADS_COUNT ; ++i )
+        threads[i] = g_thread_new("nk-format-string-test", _nk_format_string_threads_tests_thread, &data);
+    for ( i = 0 ; i < THREADS_COUNT ; ++i )
+        g_thread_join(threads[i]);
+
+    g_free(result);
+    nk_format_string_unref(data.format_string);
+}
+
+static void
+_nk_format_string_profiling_tests_func(void)
+{
+    NkFormatString *format_string;
+    NkFormatStringTokenStats *stats;
+    GError *error = NULL;
+    guint64 renders;
+    gsize size;
+    gchar *result;
+
+    format_string = nk_format_string_parse(g_strdup("${fruit}, ${none:-${bool}}, ${fruit/na/${list[2]}}!"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    g_assert_null(nk_format_string_get_stats(format_string, &size, &renders));
+    g_assert_cmpuint(size, ==, 0);
+
+    nk_format_string_set_profiling(format_string, TRUE);
+    gsize i;
+    for ( i = 0 ; i < 2 ; ++i )
+    {
+        result = nk_format_string_replace(format_string, _nk_format_string_threads_tests_callback, (gpointer) _nk_format_string_threads_tests_data);
+        g_assert_cmpstr(result, ==, "a banana, true, a bapearpear!");
+        g_free(result);
+    }
+    nk_format_string_set_profiling(format_string, FALSE);
+    result = nk_format_string_replace(format_string, _nk_format_string_threads_tests_callback, (gpointer) _nk_format_string_threads_tests_data);
+    g_free(result);
+
+    stats = nk_format_string_get_stats(format_string, &size, &renders);
+    g_assert_cmpuint(renders, ==, 2);
+    g_assert_cmpuint(size, ==, 4);
+    g_assert_cmpstr(stats[0].name, ==, "fruit");
+    g_assert_cmpuint(stats[0].calls, ==, 2);
+    g_assert_cmpuint(stats[0].bytes, ==, 2 * strlen("a banana"));
+    /* The fallback is counted in its parent too */
+    g_assert_cmpstr(stats[1].name, ==, "none");
+    g_assert_cmpuint(stats[1].calls, ==, 2);
+    g_assert_cmpuint(stats[1].bytes, ==, 2 * strlen("true"));
+    g_assert_cmpstr(stats[2].name, ==, "bool");
+    g_assert_cmpuint(stats[2].calls, ==, 2);
+    g_assert_cmpuint(stats[2].bytes, ==, 2 * strlen("true"));
+    g_assert_cmpstr(stats[3].name, ==, "fruit");
+    g_assert_cmpuint(stats[3].calls, ==, 2);
+    g_assert_cmpuint(stats[3].bytes, ==, 2 * strlen("a bapearpear"));
+    g_free(stats);
+
+    result = nk_format_string_get_stats_json(format_string);
+    g_assert_true(g_str_has_prefix(result, "{\"renders\":2,\"tokens\":[{\"name\":\"fruit\",\"calls\":2,\"callback-ns\":"));
+    g_assert_true(g_str_has_suffix(result, ",\"bytes\":24}]}"));
+    g_free(result);
+
+    nk_format_string_reset_stats(format_string);
+    stats = nk_format_string_get_stats(format_string, &size, &renders);
+    g_assert_cmpuint(renders, ==, 0);
+    g_assert_cmpuint(size, ==, 4);
+    g_assert_cmpuint(stats[0].calls, ==, 0);
+    g_free(stats);
+
+    nk_format_string_unref(format_string);
+}
+
+#define SLOW_CALLBACK_TIME 20000 /* µs */
+
+static GVariant *
+_nk_format_string_profiling_nested_tests_callback(const gchar *name, guint64 value, gpointer user_data)
+{
+    if ( g_strcmp0(name, "slow") != 0 )
+        return NULL;
+    g_usleep(SLOW_CALLBACK_TIME);
+    return g_variant_new_string("slow");
+}
+
+static void
+_nk_format_string_profiling_nested_tests_func(void)
+{
+    NkFormatString *format_string;
+    NkFormatStringTokenStats *stats;
+    GError *error = NULL;
+    guint64 renders;
+    gsize size;
+    gchar *result;
+
+    format_string = nk_format_string_parse(g_strdup("${none:-${slow}}"), '$', &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(format_string);
+
+    nk_format_string_set_profiling(format_string, TRUE);
+    result = nk_format_string_replace(format_string, _nk_format_string_profiling_nested_tests_callback, NULL);
+    g_assert_cmpstr(result, ==, "slow");
+    g_free(result);
+
+    stats = nk_format_string_get_stats(format_string, &size, &renders);
+    g_assert_cmpuint(renders, ==, 1);
+    g_assert_cmpuint(size, ==, 2);
+    g_assert_cmpstr(stats[1].name, ==, "slow");
+    g_assert_cmpuint(stats[1].callback_time, >=, SLOW_CALLBACK_TIME * 1000);
+    /* The fallback callback is the parent callback time, not its formatting */
+    g_assert_cmpstr(stats[0].name, ==, "none");
+    g_assert_cmpuint(stats[0].callback_time, >=, stats[1].callback_time);
+    g_assert_cmpuint(stats[0].format_time, <, SLOW_CALLBACK_TIME * 1000 / 2);
+    g_free(stats);
+
+    nk_format_string_unref(format_string);
+}
+
+int
+main(int argc, char *argv[])
+{
+    setlocale(LC_ALL, "C");
+
+    g_setenv("LANG", "C", TRUE);
+    g_setenv("TZ", "UTC", TRUE);
 
     g_test_init(&argc, &argv, NULL);
 
@@ -1335,5 +2414,18 @@ main(int argc, char *argv[])
     for ( i = 0 ; i < G_N_ELEMENTS(_nk_format_string_enum_tests_list) ; ++i )
         g_test_add_data_func(_nk_format_string_enum_tests_list[i].testpath, &_nk_format_string_enum_tests_list[i].data, _nk_format_string_enum_tests_func);
 
+    g_test_add_func("/nkutils/format-string/references/cache", _nk_format_string_cache_tests_func);
+    g_test_add_func("/nkutils/format-string/references/batch", _nk_format_string_batch_tests_func);
+    g_test_add_func("/nkutils/format-string/references/values", _nk_format_string_values_tests_func);
+    g_test_add_func("/nkutils/format-string/render-state", _nk_format_string_render_state_tests_func);
+    g_test_add_func("/nkutils/format-string/load/wrong", _nk_format_string_load_tests_func);
+    g_test_add_func("/nkutils/format-string/shared", _nk_format_string_shared_tests_func);
+    g_test_add_func("/nkutils/format-string/replace-cache", _nk_format_string_replace_cache_tests_func);
+    g_test_add_func("/nkutils/format-string/time-cache", _nk_format_string_time_cache_tests_func);
+    g_test_add_func("/nkutils/format-string/write", _nk_format_string_write_tests_func);
+    g_test_add_func("/nkutils/format-string/threads", _nk_format_string_threads_tests_func);
+    g_test_add_func("/nkutils/format-string/profiling", _nk_format_string_profiling_tests_func);
+    g_test_add_func("/nkutils/format-string/profiling/nested", _nk_format_string_profiling_nested_tests_func);
+
     return g_test_run();
 }
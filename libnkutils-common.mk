@@ -33,6 +33,7 @@ TESTS += \
 
 EXTRA_DIST += \
 	%D%/core/src/git-version.c \
+	%D%/core/tests/format-string-benchmark.c \
 	%D%/doc/libnkutils-man.xml \
 	%D%/core/tests/gtk-3.0/settings.ini \
 	%D%/core/tests/gtk-4.0/settings.ini \
@@ -124,6 +125,7 @@ endif
 
 if NK_ENABLE_FORMAT_STRING
 _libnkutils_sources += \
+	%D%/core/src/format-string-internal.h \
 	%D%/core/src/format-string.c \
 	%D%/core/include/nkutils-format-string.h
 